@@ -1,6 +1,7 @@
 #include "Marlin.h"
 
 #include "language.h"
+#include "gcode.h"
 /**
    GCode Command Queue
    A simple ring buffer of BUFSIZE command strings.
@@ -173,7 +174,7 @@ inline void get_serial_commands() {
             if (n2pos) npos = n2pos;
           }
 
-          gcode_N = strtol(npos + 1, NULL, 10);
+          gcode_N = parser.parse_long(npos + 1);
 
           if (gcode_N != gcode_LastN + 1 && !M110){
             gcode_line_error(PSTR(MSG_ERR_LINE_NO));
@@ -184,7 +185,7 @@ inline void get_serial_commands() {
             byte checksum = 0, count = 0;
             while (command[count] != '*') checksum ^= command[count++];
 
-            if (strtol(apos + 1, NULL, 10) != checksum){
+            if (parser.parse_long(apos + 1) != checksum){
               gcode_line_error(PSTR(MSG_ERR_CHECKSUM_MISMATCH));
               return;
             }
@@ -207,7 +208,7 @@ inline void get_serial_commands() {
         if (IsStopped()){
           char *gpos = strchr(command, 'G');
           if (gpos) {
-            const int codenum = strtol(gpos + 1, NULL, 10);
+            const int codenum = parser.parse_long(gpos + 1);
             switch (codenum) {
               case 0:
               case 1:
@@ -265,6 +266,16 @@ void process_next_command(){
   if (DEBUGGING(ECHO)) {
     // SERIAL_ECHO_START();
   }
+
+  // Parse the command once, the handlers only look up its parameters
+  parser.parse(current_command);
+
+  if (parser.seen('M')) switch (parser.value_long()) {
+    #if ENABLED(DEBUG_GCODE_PARSER)
+      case 800: parser.debug(); break; // M800 prints the parsed parameters
+    #endif
+    default: break;
+  }
 }
 
 void FlushSerialRequestResend(){
@@ -0,0 +1,121 @@
+/*
+  gcode.cpp - splits a G-code command into its parameters in a single pass
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Marlin.h"
+#include "gcode.h"
+
+GCodeParser parser;
+
+char *GCodeParser::command_ptr;
+uint32_t GCodeParser::codebits;
+char *GCodeParser::value_ptr;
+uint8_t GCodeParser::param[26];
+float GCodeParser::value[GCODE_MAX_PARAMS];
+uint8_t GCodeParser::offset[GCODE_MAX_PARAMS];
+uint8_t GCodeParser::value_index;
+
+void GCodeParser::parse(char *p)
+{
+  command_ptr = p;
+  value_ptr = p;
+  codebits = 0;
+  memset(param, 0, sizeof(param));
+
+  uint8_t count = 0;
+  for (char *s = p; *s; s++) {
+    uint8_t ind = *s - 'A';
+    if (ind >= 26 || param[ind]) continue; // Not a parameter, or not the first one of its letter
+    if (count >= GCODE_MAX_PARAMS) break;
+    codebits |= 1UL << ind;
+    offset[count] = s - p;
+    value[count] = parse_float(s + 1);
+    param[ind] = ++count;
+  }
+}
+
+// Powers of ten for the fraction, a longer fraction is scaled down in steps of 10^9
+static const float fraction_scale[] PROGMEM = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f };
+
+float GCodeParser::parse_float(const char *s)
+{
+  while (*s == ' ') s++;
+  bool negative = (*s == '-');
+  if (negative || *s == '+') s++;
+
+  // The digits are collected in a 32 bit integer, digits that do not fit any more only move the
+  // decimal point. That keeps more precision than a float has.
+  uint32_t digits = 0;
+  int8_t exponent = 0;
+  uint8_t d;
+  while ((d = *s - '0') <= 9) {
+    if (digits < 429496729UL) digits = digits * 10 + d;
+    else if (exponent < 100) exponent++;
+    s++;
+  }
+  if (*s == '.') {
+    s++;
+    while ((d = *s - '0') <= 9) {
+      if (digits < 429496729UL && exponent > -100) {
+        digits = digits * 10 + d;
+        exponent--;
+      }
+      s++;
+    }
+  }
+
+  float result = digits;
+  while (exponent < -9) {
+    result /= pgm_read_float_near(&fraction_scale[9]);
+    exponent += 9;
+  }
+  if (exponent < 0) result /= pgm_read_float_near(&fraction_scale[-exponent]);
+  while (exponent > 0) {
+    result *= 10;
+    exponent--;
+  }
+  return negative ? -result : result;
+}
+
+long GCodeParser::parse_long(const char *s)
+{
+  while (*s == ' ') s++;
+  bool negative = (*s == '-');
+  if (negative || *s == '+') s++;
+
+  unsigned long result = 0;
+  uint8_t d;
+  while ((d = *s - '0') <= 9) {
+    result = result * 10 + d;
+    s++;
+  }
+  return negative ? -(long)result : (long)result;
+}
+
+#ifdef DEBUG_GCODE_PARSER
+void GCodeParser::debug()
+{
+  SERIAL_ECHOPGM("Command: ");
+  SERIAL_ECHO(command_ptr);
+  for (char c = 'A'; c <= 'Z'; c++) {
+    if (!param[c - 'A']) continue;
+    SERIAL_ECHOPGM(" ");
+    SERIAL_ECHO(c);
+    SERIAL_ECHO(value[param[c - 'A'] - 1]);
+  }
+  SERIAL_ECHOLNPGM("");
+}
+#endif
@@ -0,0 +1,78 @@
+/*
+  gcode.h - splits a G-code command into its parameters in a single pass
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCODE_H
+#define GCODE_H
+
+#include <stdint.h>
+
+// Parameters with a value per command. Letters past that are not seen, commands that take text like
+// M117 are read from the command itself.
+#ifndef GCODE_MAX_PARAMS
+  #define GCODE_MAX_PARAMS 12
+#endif
+
+#define GCODE_BIT(letter) (1UL << ((letter) - 'A'))
+
+// parse() walks the command once. Every upper case letter is a parameter and the number behind it its
+// value, a letter that shows up twice keeps the first value like strchr() used to find it. Looking up
+// a parameter afterwards costs no scanning: seen() checks the letter and selects it, value_float() and
+// friends return the value of the selected letter.
+class GCodeParser
+{
+  public:
+    static char *command_ptr;               // The command parse() was given
+    static uint32_t codebits;               // GCODE_BIT() of every letter in the command
+    static char *value_ptr;                 // Text behind the letter selected by seen()
+
+    static void parse(char *p);
+
+    // True if the letter is in the command, it is selected for the value_*() getters then
+    static bool seen(const char c)
+    {
+      uint8_t ind = c - 'A';
+      if (ind >= 26 || !param[ind]) return false;
+      value_index = param[ind] - 1;
+      value_ptr = command_ptr + offset[value_index] + 1;
+      return true;
+    }
+
+    // True if any of the letters in mask, a set of GCODE_BIT(), is in the command
+    static bool seen_any(const uint32_t mask) { return (codebits & mask) != 0; }
+
+    static float value_float() { return value[value_index]; }
+    static long value_long() { return parse_long(value_ptr); } // Floats are exact only up to 2^24
+
+    // Numbers the way G-code writes them: leading spaces, a sign, digits and a fraction, no exponent.
+    // They stop at the first other character like strtod() and strtol(), at a fraction of the cost.
+    static float parse_float(const char *s);
+    static long parse_long(const char *s);
+
+    #ifdef DEBUG_GCODE_PARSER
+      static void debug();                  // Prints the parameters of the command
+    #endif
+
+  private:
+    static uint8_t param[26];               // Per letter 1 + its index in value[], 0 if not seen
+    static float value[GCODE_MAX_PARAMS];   // The values in the order of the letters
+    static uint8_t offset[GCODE_MAX_PARAMS]; // Where the letter of each value is in the command
+    static uint8_t value_index;             // Selected by seen()
+};
+
+extern GCodeParser parser;
+
+#endif // GCODE_H
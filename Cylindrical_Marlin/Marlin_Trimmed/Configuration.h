@@ -496,6 +496,11 @@ const bool Z_MAX_ENDSTOP_INVERTING = true; // set to true to invert the logic of
 #define DEFAULT_ZJERK                 0.4     // (mm/sec)
 #define DEFAULT_EJERK                 5.0    // (mm/sec)
 
+// Junction deviation cornering. When greater than zero, the XYZ junction speed is computed from the
+// centripetal acceleration around a circle that deviates this far from the corner, instead of from
+// DEFAULT_XYJERK/DEFAULT_ZJERK. 0 keeps the legacy jerk junctions. Change at runtime with M205 J<mm>.
+#define DEFAULT_JUNCTION_DEVIATION    0.0    // (mm)
+
 //===========================================================================
 //=============================Additional Features===========================
 //===========================================================================
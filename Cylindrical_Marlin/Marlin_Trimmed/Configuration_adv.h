@@ -88,6 +88,25 @@
 
 #define ENDSTOPS_ONLY_FOR_HOMING // If defined the endstops will only be used for homing
 
+// Watch the endstops with external and pin change interrupts instead of reading them in the stepper
+// interrupt. The first edge of a triggered endstop latches the position and ends the move, the switch
+// is ignored then until it reads released, so its bounces do not count. Endstops on pins without an
+// interrupt are polled at 1kHz instead and may travel up to 1ms past the switch.
+#define ENDSTOP_INTERRUPTS
+
+// Realtime feed hold. FEED_HOLD_CHAR received on the serial port decelerates the axes to a stop at the
+// planned acceleration without losing the position or the rest of the plan, CYCLE_START_CHAR resumes.
+// Both characters are taken out of the serial stream, so they can not be used in G-code or comments.
+// BINARY_PROTOCOL frames escape them.
+#define FEED_HOLD_CHAR '!'
+#define CYCLE_START_CHAR '~'
+
+// Measures the CPU cycles spent in the stepper and the temperature interrupt and counts the stepper
+// interrupts that end after their next OCR1A deadline. M412 reports min/max/mean per interrupt and the
+// mean per step event of the stepper interrupt, M412 R also resets.
+// Timer 5 becomes a free running cycle counter for this, analogWrite() on pins 44 to 46 stops working.
+//#define ISR_PROFILING
+
 
 //// AUTOSET LOCATIONS OF LIMIT SWITCHES
 //// Added by ZetaPhoenix 09-15-2012
@@ -222,6 +241,29 @@
 
 #define MAX_STEP_FREQUENCY 40000 // Max step frequency for Ultimaker (5000 pps / half step)
 
+// Adaptive multi-axis step smoothing. Below 5kHz the Bresenham line tracer runs up to 2^AMASS_MAX_LEVEL
+// times per step of the dominant axis, so the other axes get evenly spaced steps instead of steps
+// locked to the dominant one. The stepper interrupt runs at up to 10kHz for this, above that the
+// double and quad stepping is unchanged. compare_step_traces.py shows the step timing with and without.
+#define ADAPTIVE_STEP_SMOOTHING
+#define AMASS_MAX_LEVEL 3
+
+// Minimum width of the step pulses in microseconds, the pins also stay low at least this long between
+// two pulses. Raise it for drivers that need wider pulses. Long pulses are ended by the timer 1
+// compare B interrupt, so they do not hold up the stepper interrupt.
+#define MINIMUM_STEPPER_PULSE 2
+
+// Timer 1 prescaler of the stepper interrupt, 8 or 64. With 8 the timer counts at 2MHz on a 16MHz MCU,
+// with 64 at 250kHz, which trades the timing resolution for slower crystals or longer intervals. The
+// speed lookup tables follow F_CPU and the prescaler by themselves. Accelerations are limited to below
+// the timer rate in steps/s^2: 2000000 with 8, only 250000 with 64, see MAX_ACCELERATION_ST.
+#define STEPPER_TIMER_PRESCALER 8
+
+// Interpolate the step interval of rates above 2048 steps/s from entries 64 steps/s apart instead of
+// 256 steps/s apart. Same table size, the interval stays within a timer tick of the exact value where
+// the coarser table is up to 4 ticks off.
+//#define SPEED_LOOKUPTABLE_FINE
+
 //By default pololu step drivers require an active high signal. However, some high power drivers require an active low signal as step.
 #define INVERT_X_STEP_PIN false
 #define INVERT_Y_STEP_PIN false
@@ -237,8 +279,11 @@
 // minimum time in microseconds that a movement needs to take if the buffer is emptied.
 #define DEFAULT_MINSEGMENTTIME        20000
 
-// If defined the movements slow down when the look ahead buffer is only half full
+// If defined the movements slow down when less than SLOWDOWN_BUFFER_TIME of motion is left in the look
+// ahead buffer. Segments shorter than minsegmenttime are stretched towards it, more so the emptier the
+// buffer gets. M411 reports the buffered time.
 #define SLOWDOWN
+#define SLOWDOWN_BUFFER_TIME          200000 // (us)
 
 // Frequency limit
 // See nophead's blog for more info
@@ -250,6 +295,19 @@
 // if unwanted behavior is observed on a user's machine when running at very slow speeds.
 #define MINIMUM_PLANNER_SPEED 0.05// (mm/sec)
 
+// Calculate the trapezoid acceleration/deceleration step counts with integer math in the step domain
+// instead of soft-float divides, ceil and floor. The results match the float version within one step,
+// test/test_trapezoid.cpp checks that on the host.
+// Comment out to go back to the float trapezoid generator.
+#define FIXED_POINT_TRAPEZOID
+
+// Jerk limited (S-curve) acceleration. The constant acceleration of every ramp is replaced by a quintic
+// Bezier velocity curve that starts and ends with zero acceleration. A ramp takes the same time and
+// distance as before, but its peak acceleration is 1.875 times the configured one, so lower the
+// acceleration settings accordingly. Adds 18 bytes per block and some integer math per step.
+// compare_velocity_profiles.py prints both profiles for a given block.
+//#define S_CURVE_ACCELERATION
+
 // MS1 MS2 Stepper Driver Microstepping mode table
 #define MICROSTEP1 LOW,LOW
 #define MICROSTEP2 HIGH,LOW
@@ -334,9 +392,21 @@
 // Arc interpretation settings:
 #define MM_PER_ARC_SEGMENT 1
 #define N_ARC_CORRECTION 25
+#define N_ARC_SEGMENTS_PER_BATCH 8 // Arc segments handed to the planner at once, each one takes 16 bytes of stack
 
 const unsigned int dropsegments=5; //everything with less than this number of steps will be ignored as move and joined with the next movement
 
+// Segment coalescing: consecutive G0/G1 moves that are nearly collinear, have the same feedrate and
+// the same extrusion per mm are merged into a single planner block. Dense CAD exports then take far
+// fewer blocks, so the look-ahead covers more path, and moves below dropsegments are merged into their
+// neighbours instead of being left for the next move. Merging stops while the planner runs low.
+#define SEGMENT_COALESCING
+#ifdef SEGMENT_COALESCING
+  #define COALESCE_CHORD_TOLERANCE 0.01      // (mm) how far merged intermediate points may lie off the resulting move
+  #define COALESCE_EXTRUSION_TOLERANCE 0.01  // allowed relative difference of the extrusion per mm
+  #define COALESCE_MIN_PLANNED 2             // only hold moves back while more blocks than this are planned
+#endif
+
 // If you are using a RAMPS board or cheap E-bay purchased boards that do not detect when an SD card is inserted
 // You can get round this by connecting a push button or single throw switch to the pin defined as SDCARDCARDDETECT
 // in the pins.h file.  When using a push button pulling the pin to ground this will need inverted.  This setting should
@@ -370,10 +440,27 @@ const unsigned int dropsegments=5; //everything with less than this number of st
 // THE BLOCK_BUFFER_SIZE NEEDS TO BE A POWER OF 2, i.g. 8,16,32 because shifts and ors are used to do the ring-buffering.
 #define BLOCK_BUFFER_SIZE 16 // maximize block buffer
 
+// The stepper interrupt executes the blocks as segments of constant step rate and at most
+// SEGMENT_TIME, prepared from loop(). The segments in the buffer have to outlast anything that keeps
+// loop() busy while moving, so keep this at 16 or more.
+// THE SEGMENT_BUFFER_SIZE NEEDS TO BE A POWER OF 2 as well.
+#define SEGMENT_BUFFER_SIZE 16
+#define SEGMENT_TIME 2000 // (us)
+
 //The ASCII buffer for receiving from the serial:
 #define MAX_CMD_SIZE 96
 #define BUFSIZE 4
 
+// Accepts binary frames next to G-code lines, the first byte tells them apart. A G1 or G92 with just
+// X Y Z E F is 12 to 28 bytes with a CRC16 instead of a text line of around 40, other commands go in
+// a frame as text. The layout is in gcode.h, encode_binary_gcode.py converts G-code files.
+//#define BINARY_PROTOCOL
+
+// Serial output is queued here and sent by the UART data register empty interrupt, so replies do not
+// hold up loop(). Writing to a full buffer waits for room. A power of 2 up to 256, 0 sends every byte
+// right away and waits for the UART like before.
+#define TX_BUFFER_SIZE 32
+
 
 // Firmware based and LCD controlled retract
 // M207 and M208 can be used to define parameters for the retraction.
@@ -102,7 +102,7 @@ FORCE_INLINE void serialprintPGM(const char *str)
 
 
 void get_command();
-void process_commands();
+bool process_commands();
 
 void manage_inactivity();
 
@@ -172,7 +172,7 @@ void FlushSerialRequestResend();
 void ClearToSend();
 
 void get_coordinates();
-void prepare_move();
+bool prepare_move();
 void kill();
 void Stop();
 
@@ -180,7 +180,7 @@ bool IsStopped();
 
 void enquecommand(const char *cmd); //put an ASCII command at the end of the current buffer.
 void enquecommand_P(const char *cmd); //put an ASCII command at the end of the current buffer, read from flash
-void prepare_arc_move(char isclockwise);
+bool prepare_arc_move(char isclockwise);
 void clamp_to_software_endstops(float target[3]);
 
 void refresh_cmd_timeout(void);
@@ -30,10 +30,17 @@
 
 #if UART_PRESENT(SERIAL_PORT)
   ring_buffer rx_buffer  =  { { 0 }, 0, 0 };
+  #if TX_BUFFER_SIZE > 0
+    ring_buffer_t tx_buffer  =  { { 0 }, 0, 0 };
+  #endif
 #endif
 
 FORCE_INLINE void store_char(unsigned char c)
 {
+  #ifdef FEED_HOLD_CHAR
+    if(c == FEED_HOLD_CHAR) { st_feed_hold(); return; }
+    if(c == CYCLE_START_CHAR) { st_cycle_start(); return; }
+  #endif
   int i = (unsigned int)(rx_buffer.head + 1) % RX_BUFFER_SIZE;
 
   // if we should be storing the received character into the location
@@ -58,6 +65,28 @@ FORCE_INLINE void store_char(unsigned char c)
   }
 #endif
 
+#if TX_BUFFER_SIZE > 0
+// Moves the next byte to the UART and turns the interrupt off once the buffer is empty. Called by the
+// interrupt, or by hand when interrupts are disabled and the data register is empty.
+FORCE_INLINE void tx_udr_empty_irq(void)
+{
+  uint8_t t = tx_buffer.tail;
+  if (t != tx_buffer.head) {
+    M_UDRx = tx_buffer.buffer[t];
+    t = (t + 1) & (TX_BUFFER_SIZE - 1);
+    tx_buffer.tail = t;
+  }
+  if (t == tx_buffer.head) cbi(M_UCSRxB, M_UDRIEx);
+}
+
+#if defined(M_USARTx_UDRE_vect)
+  ISR(M_USARTx_UDRE_vect)
+  {
+    tx_udr_empty_irq();
+  }
+#endif
+#endif
+
 // Constructors ////////////////////////////////////////////////////////////////
 
 MarlinSerial::MarlinSerial()
@@ -103,8 +132,48 @@ void MarlinSerial::end()
   cbi(M_UCSRxB, M_RXENx);
   cbi(M_UCSRxB, M_TXENx);
   cbi(M_UCSRxB, M_RXCIEx);  
+  #if TX_BUFFER_SIZE > 0
+    cbi(M_UCSRxB, M_UDRIEx);
+    tx_buffer.head = tx_buffer.tail;
+  #endif
 }
 
+#if TX_BUFFER_SIZE > 0
+void MarlinSerial::write(uint8_t c)
+{
+  // Nothing queued and the UART is free, no need for the interrupt
+  if (tx_buffer.head == tx_buffer.tail && (M_UCSRxA & (1 << M_UDREx))) {
+    M_UDRx = c;
+    return;
+  }
+
+  // The interrupt can not run, send what is queued by hand and c after it
+  if (!(SREG & (1 << SREG_I))) {
+    flushTX();
+    while (!((M_UCSRxA) & (1 << M_UDREx)))
+      ;
+    M_UDRx = c;
+    return;
+  }
+
+  uint8_t i = (tx_buffer.head + 1) & (TX_BUFFER_SIZE - 1);
+  // Buffer full, wait for the interrupt to make room
+  while (i == tx_buffer.tail)
+    ;
+  tx_buffer.buffer[tx_buffer.head] = c;
+  tx_buffer.head = i;
+  sbi(M_UCSRxB, M_UDRIEx);
+}
+
+void MarlinSerial::flushTX(void)
+{
+  while (tx_buffer.head != tx_buffer.tail) {
+    if (!(SREG & (1 << SREG_I)) && (M_UCSRxA & (1 << M_UDREx)))
+      tx_udr_empty_irq();
+  }
+}
+#endif
+
 
 
 int MarlinSerial::peek(void)
@@ -258,6 +327,12 @@ void MarlinSerial::println(double n, int digits)
 
 // Private Methods /////////////////////////////////////////////////////////////
 
+// Decimal digits are taken off by subtracting powers of ten, a 32 bit division per digit costs a lot
+// more on the AVR
+static const unsigned long powers_of_ten[] PROGMEM = {
+  1UL, 10UL, 100UL, 1000UL, 10000UL, 100000UL, 1000000UL, 10000000UL, 100000000UL, 1000000000UL
+};
+
 void MarlinSerial::printNumber(unsigned long n, uint8_t base)
 {
   unsigned char buf[8 * sizeof(long)]; // Assumes 8-bit chars. 
@@ -268,6 +343,21 @@ void MarlinSerial::printNumber(unsigned long n, uint8_t base)
     return;
   } 
 
+  if (base == 10) {
+    bool leading = true;
+    for (int8_t p = 9; p >= 0; p--) {
+      unsigned long power = pgm_read_dword_near(&powers_of_ten[p]);
+      char digit = '0';
+      while (n >= power) {
+        n -= power;
+        digit++;
+      }
+      if (digit != '0') leading = false;
+      if (!leading) print(digit);
+    }
+    return;
+  }
+
   while (n > 0) {
     buf[i++] = n % base;
     n /= base;
@@ -288,6 +378,26 @@ void MarlinSerial::printFloat(double number, uint8_t digits)
      number = -number;
   }
 
+  // Up to 9 digits the number is scaled to an integer and printed with integer math, the float
+  // arithmetic per digit below is much slower on the AVR. Numbers too large for that (and NaN) use it.
+  if (digits <= 9) {
+    unsigned long scale = pgm_read_dword_near(&powers_of_ten[digits]);
+    double scaled = number * scale + 0.5;
+    if (scaled < 4294967295.0) {
+      unsigned long n = scaled;
+      unsigned long int_part = n / scale;
+      unsigned long fraction = n - int_part * scale;
+      print(int_part);
+      if (digits > 0) {
+        print('.');
+        for (uint8_t i = digits - 1; i > 0 && fraction < pgm_read_dword_near(&powers_of_ten[i]); i--)
+          print('0');
+        print(fraction);
+      }
+      return;
+    }
+  }
+
   // Round correctly so that print(1.999, 2) prints as "2.00"
   double rounding = 0.5;
   for (uint8_t i=0; i<digits; ++i)
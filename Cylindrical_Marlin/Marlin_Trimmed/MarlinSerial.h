@@ -49,11 +49,13 @@
 #define M_TXENx SERIAL_REGNAME(TXEN,SERIAL_PORT,)    
 #define M_RXCIEx SERIAL_REGNAME(RXCIE,SERIAL_PORT,)    
 #define M_UDREx SERIAL_REGNAME(UDRE,SERIAL_PORT,)    
+#define M_UDRIEx SERIAL_REGNAME(UDRIE,SERIAL_PORT,)
 #define M_UDRx SERIAL_REGNAME(UDR,SERIAL_PORT,)  
 #define M_UBRRxH SERIAL_REGNAME(UBRR,SERIAL_PORT,H)
 #define M_UBRRxL SERIAL_REGNAME(UBRR,SERIAL_PORT,L)
 #define M_RXCx SERIAL_REGNAME(RXC,SERIAL_PORT,)
 #define M_USARTx_RX_vect SERIAL_REGNAME(USART,SERIAL_PORT,_RX_vect)
+#define M_USARTx_UDRE_vect SERIAL_REGNAME(USART,SERIAL_PORT,_UDRE_vect)
 #define M_U2Xx SERIAL_REGNAME(U2X,SERIAL_PORT,)
 
 
@@ -80,8 +82,34 @@ struct ring_buffer
   int tail;
 };
 
+#ifndef TX_BUFFER_SIZE
+  #define TX_BUFFER_SIZE 32
+#endif
+#if !((TX_BUFFER_SIZE == 256) ||(TX_BUFFER_SIZE == 128) ||(TX_BUFFER_SIZE == 64) ||(TX_BUFFER_SIZE == 32) ||(TX_BUFFER_SIZE == 16) ||(TX_BUFFER_SIZE == 8) ||(TX_BUFFER_SIZE == 4) ||(TX_BUFFER_SIZE == 2) ||(TX_BUFFER_SIZE == 0))
+  #error TX_BUFFER_SIZE has to be a power of 2 or 0
+#endif
+
+#if TX_BUFFER_SIZE > 0
+// Outgoing bytes, written at head by write() and sent from tail by the data register empty interrupt
+struct ring_buffer_t
+{
+  unsigned char buffer[TX_BUFFER_SIZE];
+  volatile uint8_t head;
+  volatile uint8_t tail;
+};
+#endif
+
 #if UART_PRESENT(SERIAL_PORT)
   extern ring_buffer rx_buffer;
+  #if TX_BUFFER_SIZE > 0
+    extern ring_buffer_t tx_buffer;
+  #endif
+#endif
+
+#ifdef FEED_HOLD_CHAR
+// The realtime commands act as soon as they are received and never reach the command buffer
+void st_feed_hold();
+void st_cycle_start();
 #endif
 
 class MarlinSerial //: public Stream
@@ -100,6 +128,13 @@ class MarlinSerial //: public Stream
       return (unsigned int)(RX_BUFFER_SIZE + rx_buffer.head - rx_buffer.tail) % RX_BUFFER_SIZE;
     }
     
+    #if TX_BUFFER_SIZE > 0
+    // Queues c for the interrupt, waits only if the buffer is full. With interrupts disabled, in an
+    // interrupt handler or after kill(), it sends the buffer and c right away instead.
+    void write(uint8_t c);
+    // Waits until every queued byte went to the UART
+    void flushTX(void);
+    #else
     FORCE_INLINE void write(uint8_t c)
     {
       while (!((M_UCSRxA) & (1 << M_UDREx)))
@@ -107,12 +142,17 @@ class MarlinSerial //: public Stream
 
       M_UDRx = c;
     }
+    #endif
     
     
     FORCE_INLINE void checkRx(void)
     {
       if((M_UCSRxA & (1<<M_RXCx)) != 0) {
         unsigned char c  =  M_UDRx;
+        #ifdef FEED_HOLD_CHAR
+          if(c == FEED_HOLD_CHAR) { st_feed_hold(); return; }
+          if(c == CYCLE_START_CHAR) { st_cycle_start(); return; }
+        #endif
         int i = (unsigned int)(rx_buffer.head + 1) % RX_BUFFER_SIZE;
 
         // if we should be storing the received character into the location
@@ -39,6 +39,7 @@
 #include "pins_arduino.h"
 #include "math.h"
 #include "SoftwareSerial.h"
+#include "gcode.h"
 //#include <SoftwareSerial.h> //added for modular gantry system
 SoftwareSerial mySerial1(42,44);// (RX, TX) added for modular gantry system
 
@@ -92,6 +93,7 @@ SoftwareSerial mySerial1(42,44);// (RX, TX) added for modular gantry system
 // M203 - Set maximum feedrate that your machine can sustain (M203 X200 Y200 Z300 E10000) in mm/sec
 // M204 - Set default acceleration: S normal moves T filament only moves (M204 S3000 T7000) in mm/sec^2  also sets minimum segment time in ms (B20000) to prevent buffer under-runs and M20 minimum feedrate
 // M205 -  advanced settings:  minimum travel speed S=while printing T=travel only,  B=minimum segment time X= maximum xy jerk, Z=maximum Z jerk, E=maximum E jerk
+//        J=junction deviation in mm, J0 switches back to the X/Z jerk junctions
 // M206 - set additional homing offset
 // M207 - set retract length S[positive mm] F[feedrate mm/min] Z[additional zlift/hop], stays in mm regardless of M200 setting
 // M208 - set recover=unretract length S[positive mm surplus to the M207 S*] F[feedrate mm/sec]
@@ -110,6 +112,9 @@ SoftwareSerial mySerial1(42,44);// (RX, TX) added for modular gantry system
 // M400 - Finish all moves
 // M401 - Lower z-probe if present
 // M402 - Raise z-probe if present
+// M410 - Stop at the planned deceleration and drop all buffered moves, the position is kept
+// M411 - Report the planner buffer: queued blocks and the buffered motion time in ms
+// M412 - Report the cycles spent in the stepper and temperature interrupts (ISR_PROFILING), R resets them
 // M500 - stores parameters in EEPROM
 // M501 - reads parameters from EEPROM (if you need reset them after you changed them temporarily).
 // M502 - reverts to the default "factory settings".  You still need to store them in EEPROM afterwards if you want to.
@@ -203,6 +208,17 @@ static char serial_char;
 static int serial_count = 0;
 static boolean comment_mode = false;
 static char *strchr_pointer; // just a pointer to find chars in the command string like X, Y, Z, E, etc
+static bool command_parsed = false; // cmdbuffer[bufindr] is in the parser already
+#ifdef BINARY_PROTOCOL
+  static bool binary_frame = false;  // A frame is coming in instead of a G-code line
+  static bool binary_escape = false; // The last frame byte was BINARY_ESCAPE
+  static bool binary_resync = false; // Bytes are dropped up to the next BINARY_FRAME_START
+  #define BINARY_MAX_PAYLOAD (MAX_CMD_SIZE - BINARY_HEADER_SIZE - BINARY_CRC_SIZE)
+  #ifdef FEED_HOLD_CHAR
+    // encode_binary_gcode.py escapes these two in frames
+    typedef char realtime_chars_have_to_be_the_ones_encode_binary_gcode_escapes[(FEED_HOLD_CHAR == '!' && CYCLE_START_CHAR == '~') ? 1 : -1];
+  #endif
+#endif
 
 const int sensitive_pins[] = SENSITIVE_PINS; // Sensitive pin list for M42
 
@@ -389,10 +405,30 @@ void loop()
     get_command();
   if(buflen)
   {
-    process_commands();
-    buflen = (buflen-1);
-    bufindr = (bufindr + 1)%BUFSIZE;
+    // The command is parsed once, code_seen() and code_value() only look the parameters up
+    if(!command_parsed) {
+      #ifdef BINARY_PROTOCOL
+        if((uint8_t)cmdbuffer[bufindr][0] == BINARY_FRAME_START)
+          parser.parse_binary(cmdbuffer[bufindr]);
+        else
+      #endif
+      parser.parse(cmdbuffer[bufindr]);
+      command_parsed = true;
+    }
+    // A move that did not fit in the planner stays in the command buffer and is retried on the
+    // next pass, so the heaters and the serial intake keep being serviced from here meanwhile.
+    if(process_commands())
+    {
+      buflen = (buflen-1);
+      bufindr = (bufindr + 1)%BUFSIZE;
+      command_parsed = false;
+    }
+  }
+  else
+  {
+    mc_line_flush(); // No next move to merge with, let the planner have the held back one
   }
+  st_prep_buffer(); // Keep the stepper fed before the slower housekeeping below
   //check heater every n milliseconds
   manage_heater();
   manage_inactivity();
@@ -400,10 +436,142 @@ void loop()
   lcd_update();
 }
 
+// Queues the command in cmdbuffer[bufindw], g_code is its G number or -1
+static void queue_serial_command(long g_code)
+{
+  switch(g_code){
+  case 0:
+  case 1:
+  case 2:
+  case 3:
+    if(Stopped == false) { // If printer is stopped by an error the G[0-3] codes are ignored.
+      SERIAL_PROTOCOLLNPGM(MSG_OK);
+    }
+    else {
+      SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
+      LCD_MESSAGEPGM(MSG_STOPPED);
+    }
+    break;
+  default:
+    break;
+  }
+  //If command was e-stop process now
+  if(strcmp(cmdbuffer[bufindw], "M112") == 0)
+    kill();
+
+  fromsd[bufindw] = false;
+  bufindw = (bufindw + 1)%BUFSIZE;
+  buflen += 1;
+}
+
+// The command is the first letter after the line number, a G in the text of M117 is not a G-code
+static long serial_command_g()
+{
+  char *p = cmdbuffer[bufindw];
+  while(*p == ' ') p++;
+  if(*p == 'N') {
+    p++;
+    while(*p == ' ' || *p == '-' || (*p >= '0' && *p <= '9')) p++;
+  }
+  return *p == 'G' ? parser.parse_long(p + 1) : -1;
+}
+
+#ifdef BINARY_PROTOCOL
+// Collects a frame in cmdbuffer[bufindw] one byte at a time, without the byte stuffing. A complete
+// frame is checked like a line with N and *, then moves stay a frame for parse_binary() and text
+// becomes a normal command.
+static void get_binary_frame_byte()
+{
+  uint8_t c = serial_char;
+  if(c == BINARY_FRAME_START) {
+    // A frame cut short by it is dropped, the sequence number of this one tells the host
+    binary_frame = true;
+    binary_escape = false;
+    binary_resync = false;
+    serial_count = 0;
+  }
+  else if(!binary_frame) {
+    return; // Resynchronizing
+  }
+  else if(c == BINARY_ESCAPE) {
+    binary_escape = true;
+    return;
+  }
+  else if(binary_escape) {
+    c ^= BINARY_ESCAPE_XOR;
+    binary_escape = false;
+  }
+  cmdbuffer[bufindw][serial_count++] = c;
+  if(serial_count < BINARY_HEADER_SIZE)
+    return;
+  uint8_t length = cmdbuffer[bufindw][2];
+  if(length > BINARY_MAX_PAYLOAD) {
+    // Where this frame ends is unknown, its bytes are not taken for G-code but skipped up to the next
+    // start byte
+    binary_frame = false;
+    binary_resync = true;
+    serial_count = 0;
+    SERIAL_ERROR_START;
+    SERIAL_ERRORPGM(MSG_ERR_BINARY_FRAME);
+    SERIAL_ERRORLN(gcode_LastN);
+    FlushSerialRequestResend();
+    return;
+  }
+  if(serial_count < BINARY_HEADER_SIZE + length + BINARY_CRC_SIZE)
+    return;
+  binary_frame = false;
+  serial_count = 0;
+
+  if(!parser.binary_frame_valid(cmdbuffer[bufindw])) {
+    SERIAL_ERROR_START;
+    SERIAL_ERRORPGM(MSG_ERR_BINARY_FRAME);
+    SERIAL_ERRORLN(gcode_LastN);
+    FlushSerialRequestResend();
+    return;
+  }
+
+  uint8_t opcode = cmdbuffer[bufindw][1];
+  uint16_t sequence = (uint8_t)cmdbuffer[bufindw][3] | ((uint8_t)cmdbuffer[bufindw][4] << 8);
+  if(opcode == BINARY_OP_TEXT) {
+    memmove(cmdbuffer[bufindw], cmdbuffer[bufindw] + BINARY_HEADER_SIZE, length);
+    cmdbuffer[bufindw][length] = 0;
+  }
+
+  // Only the low 16 bits of the line number are sent, M110 sets them like N does for a line
+  if(opcode == BINARY_OP_TEXT && strstr_P(cmdbuffer[bufindw], PSTR("M110")) != NULL) {
+    gcode_N = sequence;
+  }
+  else {
+    gcode_N = gcode_LastN + 1;
+    if(sequence != (uint16_t)gcode_N) {
+      SERIAL_ERROR_START;
+      SERIAL_ERRORPGM(MSG_ERR_LINE_NO);
+      SERIAL_ERRORLN(gcode_LastN);
+      FlushSerialRequestResend();
+      return;
+    }
+  }
+  gcode_LastN = gcode_N;
+
+  if(opcode == BINARY_OP_MOVE)
+    queue_serial_command(1);
+  else if(opcode == BINARY_OP_SET_POSITION)
+    queue_serial_command(92);
+  else
+    queue_serial_command(serial_command_g());
+}
+#endif
+
 void get_command()
 {
   while( MYSERIAL.available() > 0  && buflen < BUFSIZE) {
     serial_char = MYSERIAL.read();
+    #ifdef BINARY_PROTOCOL
+      if(binary_frame || binary_resync || (serial_count == 0 && comment_mode == false && (uint8_t)serial_char == BINARY_FRAME_START)) {
+        get_binary_frame_byte();
+        continue;
+      }
+    #endif
     if(serial_char == '\n' ||
        serial_char == '\r' ||
        (serial_char == ':' && comment_mode == false) ||
@@ -416,11 +584,10 @@ void get_command()
       cmdbuffer[bufindw][serial_count] = 0; //terminate string
       if(!comment_mode){
         comment_mode = false; //for new command
-        fromsd[bufindw] = false;
         if(strchr(cmdbuffer[bufindw], 'N') != NULL)
         {
           strchr_pointer = strchr(cmdbuffer[bufindw], 'N');
-          gcode_N = (strtol(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL, 10));
+          gcode_N = parser.parse_long(strchr_pointer + 1);
           if(gcode_N != gcode_LastN+1 && (strstr_P(cmdbuffer[bufindw], PSTR("M110")) == NULL) ) {
             SERIAL_ERROR_START;
             SERIAL_ERRORPGM(MSG_ERR_LINE_NO);
@@ -438,7 +605,7 @@ void get_command()
             while(cmdbuffer[bufindw][count] != '*') checksum = checksum^cmdbuffer[bufindw][count++];
             strchr_pointer = strchr(cmdbuffer[bufindw], '*');
 
-            if( (int)(strtod(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL)) != checksum) {
+            if(parser.parse_long(strchr_pointer + 1) != checksum) {
               SERIAL_ERROR_START;
               SERIAL_ERRORPGM(MSG_ERR_CHECKSUM_MISMATCH);
               SERIAL_ERRORLN(gcode_LastN);
@@ -472,31 +639,7 @@ void get_command()
             return;
           }
         }
-        if((strchr(cmdbuffer[bufindw], 'G') != NULL)){
-          strchr_pointer = strchr(cmdbuffer[bufindw], 'G');
-          switch((int)((strtod(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL)))){
-          case 0:
-          case 1:
-          case 2:
-          case 3:
-            if(Stopped == false) { // If printer is stopped by an error the G[0-3] codes are ignored.
-              SERIAL_PROTOCOLLNPGM(MSG_OK);
-            }
-            else {
-              SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
-              LCD_MESSAGEPGM(MSG_STOPPED);
-            }
-            break;
-          default:
-            break;
-          }
-        }
-        //If command was e-stop process now
-        if(strcmp(cmdbuffer[bufindw], "M112") == 0)
-          kill();
-        
-        bufindw = (bufindw + 1)%BUFSIZE;
-        buflen += 1;
+        queue_serial_command(serial_command_g());
       }
       serial_count = 0; //clear buffer
     }
@@ -511,18 +654,19 @@ void get_command()
 
 float code_value()
 {
-  return (strtod(&cmdbuffer[bufindr][strchr_pointer - cmdbuffer[bufindr] + 1], NULL));
+  return parser.value_float();
 }
 
 long code_value_long()
 {
-  return (strtol(&cmdbuffer[bufindr][strchr_pointer - cmdbuffer[bufindr] + 1], NULL, 10));
+  return parser.value_long();
 }
 
 bool code_seen(char code)
 {
-  strchr_pointer = strchr(cmdbuffer[bufindr], code);
-  return (strchr_pointer != NULL);  //Return True if a character was found
+  if(!parser.seen(code)) return false;
+  strchr_pointer = parser.value_ptr - 1; // M117 takes its text from behind the M
+  return true;
 }
 
 #define DEFINE_PGM_READ_ANY(type, reader)       \
@@ -591,11 +735,42 @@ void refresh_cmd_timeout(void)
   previous_millis_cmd = millis();
 }
 
-void process_commands()
+// Everything has to see all moves in the planner, including one held back for merging, except G0/G1
+// that merge with it and the commands below that leave the planner alone. A feed hold can keep the
+// planner full, these still run then.
+static bool command_skips_flush()
+{
+  if(parser.command_letter == 'G' && code_seen('G'))
+    return (int)code_value() == 0 || (int)code_value() == 1;
+  if(parser.command_letter == 'M' && code_seen('M')) {
+    switch((int)code_value()) {
+    case 105:
+    case 114:
+    case 115:
+    case 119:
+    case 410: // Drops the held back move, see below
+    case 411:
+    case 412:
+    case 503:
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns false if the command has to be executed again later because the planner was full
+bool process_commands()
 {
   unsigned long codenum; //throw away variable
   char *starpos = NULL;
-  if(code_seen('G'))
+  if(!command_skips_flush())
+  {
+    if(!mc_line_flush())
+      return false;
+  }
+  // Commands are told apart by parser.command_letter, code_seen('G') alone also finds a G in the text
+  // of M117
+  if(parser.command_letter == 'G' && code_seen('G'))
   {
     switch((int)code_value())
     {
@@ -603,23 +778,20 @@ void process_commands()
     case 1: // G1
       if(Stopped == false) {
         get_coordinates(); // For X Y Z E F
-        prepare_move();
         //ClearToSend();
-        return;
+        return prepare_move();
       }
       break;
     case 2: // G2  - CW ARC
       if(Stopped == false) {
         get_arc_coordinates();
-        prepare_arc_move(true);
-        return;
+        return prepare_arc_move(true);
       }
       break;
     case 3: // G3  - CCW ARC
       if(Stopped == false) {
         get_arc_coordinates();
-        prepare_arc_move(false);
-        return;
+        return prepare_arc_move(false);
       }
       break;
     case 4: // G4 dwell
@@ -662,7 +834,7 @@ void process_commands()
         destination[i] = current_position[i];
       }
       feedrate = 0.0;
-      home_all_axis = !((code_seen(axis_codes[X_AXIS])) || (code_seen(axis_codes[Y_AXIS])) || (code_seen(axis_codes[Z_AXIS])));
+      home_all_axis = !parser.seen_any(GCODE_BIT('X') | GCODE_BIT('Y') | GCODE_BIT('Z'));
 
       #if Z_HOME_DIR > 0                      // If homing away from BED do Z first
       if((home_all_axis) || (code_seen(axis_codes[Z_AXIS]))) {
@@ -790,7 +962,7 @@ void process_commands()
     }
   }
       
-  else if(code_seen('M'))
+  else if(parser.command_letter == 'M' && code_seen('M'))
   {
     switch( (int)code_value() )
     {
@@ -893,7 +1065,7 @@ void process_commands()
         SERIAL_PROTOCOL(getHeaterPower(-1));
 
         SERIAL_PROTOCOLLN("");
-      return;
+      return true;
       break;
     case 109:
     {// M109 - Wait for extruder heater to reach target.
@@ -1148,12 +1320,16 @@ void process_commands()
       SERIAL_PROTOCOLPGM(" E:");
       SERIAL_PROTOCOL(current_position[E_AXIS]);
 
-      SERIAL_PROTOCOLPGM(MSG_COUNT_X);
-      SERIAL_PROTOCOL(float(st_get_position(X_AXIS))/axis_steps_per_unit[X_AXIS]);
-      SERIAL_PROTOCOLPGM(" Y:");
-      SERIAL_PROTOCOL(float(st_get_position(Y_AXIS))/axis_steps_per_unit[Y_AXIS]);
-      SERIAL_PROTOCOLPGM(" Z:");
-      SERIAL_PROTOCOL(float(st_get_position(Z_AXIS))/axis_steps_per_unit[Z_AXIS]);
+      {
+        long count[NUM_AXIS];
+        st_get_positions(count);
+        SERIAL_PROTOCOLPGM(MSG_COUNT_X);
+        SERIAL_PROTOCOL(float(count[X_AXIS])/axis_steps_per_unit[X_AXIS]);
+        SERIAL_PROTOCOLPGM(" Y:");
+        SERIAL_PROTOCOL(float(count[Y_AXIS])/axis_steps_per_unit[Y_AXIS]);
+        SERIAL_PROTOCOLPGM(" Z:");
+        SERIAL_PROTOCOL(float(count[Z_AXIS])/axis_steps_per_unit[Z_AXIS]);
+      }
 
       SERIAL_PROTOCOLLN("");
       break;
@@ -1247,7 +1423,7 @@ void process_commands()
         if(code_seen('T')) retract_acceleration = code_value() ;
       }
       break;
-    case 205: //M205 advanced settings:  minimum travel speed S=while printing T=travel only,  B=minimum segment time X= maximum xy jerk, Z=maximum Z jerk
+    case 205: //M205 advanced settings:  minimum travel speed S=while printing T=travel only,  B=minimum segment time X= maximum xy jerk, Z=maximum Z jerk, J=junction deviation
     {
       if(code_seen('S')) minimumfeedrate = code_value();
       if(code_seen('T')) mintravelfeedrate = code_value();
@@ -1255,6 +1431,7 @@ void process_commands()
       if(code_seen('X')) max_xy_jerk = code_value() ;
       if(code_seen('Z')) max_z_jerk = code_value() ;
       if(code_seen('E')) max_e_jerk = code_value() ;
+      if(code_seen('J')) junction_deviation = max(code_value(), 0.0) ;
     }
     break;
     case 206: // M206 additional homeing offset
@@ -1293,7 +1470,9 @@ void process_commands()
     {
       if(code_seen('S'))
       {
-        feedmultiply = code_value() ;
+        // At least 1%. New blocks would take 0 as no override, the buffered ones would get a rate of 0
+        feedmultiply = max((int)code_value(), 1);
+        plan_update_overrides();
       }
     }
     break;
@@ -1301,7 +1480,8 @@ void process_commands()
     {
       if(code_seen('S'))
       {
-        int tmp_code = code_value();
+        // At least 1%, the moves already buffered are rescaled by the ratio to the previous factor
+        int tmp_code = max((int)code_value(), 1);
         if (code_seen('T'))
         {
           if(setTargetedHotend(221)){
@@ -1312,6 +1492,7 @@ void process_commands()
         else
         {
           extrudemultiply = tmp_code ;
+          plan_update_overrides();
         }
       }
     }
@@ -1452,6 +1633,35 @@ void process_commands()
       st_synchronize();
     }
     break;
+    case 410: // M410 quickstop, the buffered moves are dropped but the position stays known
+    {
+      mc_line_discard();
+      quickStop();
+      long count[NUM_AXIS];
+      st_get_positions(count);
+      for(int8_t i=0; i < NUM_AXIS; i++) {
+        current_position[i] = count[i] / axis_steps_per_unit[i];
+      }
+    }
+    break;
+    case 411: // M411 report planner buffer
+    {
+      SERIAL_PROTOCOLPGM("Blocks:");
+      SERIAL_PROTOCOL((int)movesplanned());
+      SERIAL_PROTOCOLPGM("/");
+      SERIAL_PROTOCOL(BLOCK_BUFFER_SIZE - 1);
+      SERIAL_PROTOCOLPGM(" Buffered:");
+      SERIAL_PROTOCOL(plan_buffered_time() / 1000);
+      SERIAL_PROTOCOLLNPGM("ms");
+    }
+    break;
+    #ifdef ISR_PROFILING
+    case 412: // M412 report the interrupt profile, M412 R also resets it
+    {
+      st_report_isr_profile(code_seen('R'));
+    }
+    break;
+    #endif
     case 500: // M500 Store settings in EEPROM
     {
         Config_StoreSettings();
@@ -1559,7 +1769,7 @@ void process_commands()
 //The 'B' can stand for Bioprinter, Biomedical Engineering, Binghamton, etc.  
 //START B-CODE
 
-  else if(code_seen('B'))
+  else if(parser.command_letter == 'B' && code_seen('B'))
   {
     switch( (int)code_value() )
     {
@@ -1577,7 +1787,7 @@ void process_commands()
   
   //END B-Code
   
-  else if(code_seen('T'))
+  else if(parser.command_letter == 'T' && code_seen('T'))
   {
     tmp_extruder = code_value();
     if(tmp_extruder >= EXTRUDERS) {
@@ -1611,7 +1821,11 @@ void process_commands()
         plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
         // Move to the old position if 'F' was in the parameters
         if(make_move && Stopped == false) {
-           prepare_move();
+           while(!prepare_move()) {
+             manage_heater();
+             manage_inactivity();
+             lcd_update();
+           }
         }
       }
       #endif
@@ -1630,6 +1844,7 @@ void process_commands()
   }
 
   ClearToSend();
+  return true;
 }
 
 void FlushSerialRequestResend()
@@ -1704,30 +1919,31 @@ void clamp_to_software_endstops(float target[3])
   }
 }
 
-void prepare_move()
+bool prepare_move()
 {
   clamp_to_software_endstops(destination);
 
   previous_millis_cmd = millis();
 
-  // Do not use feedmultiply for E or Z only moves
-  if( (current_position[X_AXIS] == destination [X_AXIS]) && (current_position[Y_AXIS] == destination [Y_AXIS])) {
-      plan_buffer_line(destination[X_AXIS], destination[Y_AXIS], destination[Z_AXIS], destination[E_AXIS], feedrate/60, active_extruder);
-  }
-  else {
-    plan_buffer_line(destination[X_AXIS], destination[Y_AXIS], destination[Z_AXIS], destination[E_AXIS], feedrate*feedmultiply/60/100.0, active_extruder);
+  // feedmultiply is applied by the planner, so a change also reaches the moves already buffered
+  float feed_rate = feedrate/60;
+  if(!mc_line(current_position, destination, feed_rate, active_extruder)) {
+    return false;
   }
 
   for(int8_t i=0; i < NUM_AXIS; i++) {
     current_position[i] = destination[i];
   }
+  return true;
 }
 
-void prepare_arc_move(char isclockwise) {
+bool prepare_arc_move(char isclockwise) {
   float r = hypot(offset[X_AXIS], offset[Y_AXIS]); // Compute arc radius for mc_arc
 
-  // Trace the arc
-  mc_arc(current_position, destination, offset, X_AXIS, Y_AXIS, Z_AXIS, feedrate*feedmultiply/60/100.0, r, isclockwise, active_extruder);
+  // Trace the arc, it may take several calls until all segments fit in the planner
+  if(!mc_arc(current_position, destination, offset, X_AXIS, Y_AXIS, Z_AXIS, feedrate/60, r, isclockwise, active_extruder)) {
+    return false;
+  }
 
   // As far as the parser is concerned, the position is now == target. In reality the
   // motion control system might still be processing the action and the real tool position
@@ -1736,13 +1952,13 @@ void prepare_arc_move(char isclockwise) {
     current_position[i] = destination[i];
   }
   previous_millis_cmd = millis();
+  return true;
 }
 
+// Only loop() reads new commands, so waiting loops calling this can not re-enter the command reader
 void manage_inactivity()
 {
-  if(buflen < (BUFSIZE-1))
-    get_command();
-
+  st_prep_buffer(); // Every wait loop passes here, keep the stepper fed while waiting
   if( (millis() - previous_millis_cmd) >  max_inactive_time )
     if(max_inactive_time)
       kill();
@@ -1813,6 +2029,7 @@ void Stop()
   disable_heater();
   if(Stopped == false) {
     Stopped = true;
+    mc_arc_abort(); // An interrupted arc must not be continued after M999
     Stopped_gcode_LastN = gcode_LastN; // Save last g_code for restart
     SERIAL_ERROR_START;
     SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
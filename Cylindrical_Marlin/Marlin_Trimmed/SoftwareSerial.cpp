@@ -218,10 +218,16 @@ inline void SoftwareSerial::handle_interrupt()
   }
 }
 
+// The vectors can only be defined once, other users of the pin change interrupts (the endstops
+// of the stepper driver) define this hook.
+void pin_change_hook() __attribute__((weak));
+
 #if defined(PCINT0_vect)
 ISR(PCINT0_vect)
 {
   SoftwareSerial::handle_interrupt();
+  if (pin_change_hook)
+    pin_change_hook();
 }
 #endif
 
@@ -0,0 +1,125 @@
+#!/usr/bin/env python
+""" Compares the step timing of the stepper interrupt with and without ADAPTIVE_STEP_SMOOTHING.
+
+One block is traced at a constant step rate with the same Bresenham counters, step_loops and smoothing
+levels as ISR(TIMER1_COMPA_vect). The timer interval is taken as (F_CPU/8)/rate instead of the
+speed_lookuptable.h interpolation. For every axis the steps are compared with ideal, evenly spaced
+steps over the duration of the block.
+
+Prints the worst timing error and the spread of the step intervals per axis, or every step as CSV
+with --csv. Example, 1000 X steps and 333 Y steps at 2000 steps/s:
+
+  python compare_step_traces.py --steps 1000 333 0 0 --rate 2000
+"""
+
+from __future__ import print_function
+
+import argparse
+
+F_CPU = 16000000
+TIMER_RATE = F_CPU / 8  # stepper timer ticks per second
+MAX_STEP_FREQUENCY = 40000
+AMASS_MAX_LEVEL = 3
+AXES = 'XYZE'
+
+
+def calc_timer(step_rate):
+    """ Returns (timer, step_loops) like calc_timer() of stepper.cpp """
+    step_rate = min(step_rate, MAX_STEP_FREQUENCY)
+    step_loops = 1
+    if step_rate > 20000:
+        step_rate >>= 2
+        step_loops = 4
+    elif step_rate > 10000:
+        step_rate >>= 1
+        step_loops = 2
+    return max(int(TIMER_RATE / max(step_rate, 32)), 100), step_loops
+
+
+def amass_level(step_rate):
+    level = 0
+    while level < AMASS_MAX_LEVEL and step_rate <= (10000 >> (level + 1)):
+        level += 1
+    return level
+
+
+def trace(steps, rate, smoothing):
+    """ Returns the step times of every axis and the number of interrupts for one block """
+    event_count = max(steps)
+    level = amass_level(rate) if smoothing else 0
+    full_step = 1 << AMASS_MAX_LEVEL if smoothing else 1
+    shift = AMASS_MAX_LEVEL - level if smoothing else 0
+    timer, step_loops = calc_timer(rate << level)
+    counters = [-((event_count * full_step) >> 1)] * len(steps)
+    times = [[] for _ in steps]
+    phase = 0
+    completed = 0
+    interrupts = 0
+    while completed < event_count:
+        # the interrupt pulses the pins when it fires, then programs the next interval
+        now = interrupts * timer / float(TIMER_RATE)
+        interrupts += 1
+        for _ in range(step_loops):
+            for axis in range(len(steps)):
+                counters[axis] += steps[axis] << shift
+                if counters[axis] > 0:
+                    counters[axis] -= event_count * full_step
+                    times[axis].append(now)
+            phase += 1 << shift
+            if phase < full_step:
+                continue
+            phase = 0
+            completed += 1
+            if completed >= event_count:
+                break
+    return times, interrupts, interrupts * timer / float(TIMER_RATE)
+
+
+def axis_report(step_times, count, duration):
+    """ Worst deviation from evenly spaced steps and the smallest and largest interval, in us """
+    if count == 0:
+        return None
+    spacing = duration / count
+    error = max(abs(t - (i + 0.5) * spacing) for i, t in enumerate(step_times))
+    intervals = [b - a for a, b in zip(step_times, step_times[1:])] or [0.0]
+    return error * 1e6, min(intervals) * 1e6, max(intervals) * 1e6
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--steps', type=int, nargs=4, default=[1000, 333, 0, 0], metavar='N',
+                        help='steps_x steps_y steps_z steps_e of the block')
+    parser.add_argument('--rate', type=int, default=2000, help='step rate of the dominant axis in steps/s')
+    parser.add_argument('--csv', action='store_true', help='print every step instead of the summary')
+    args = parser.parse_args()
+
+    steps = [abs(n) for n in args.steps]
+    if max(steps) == 0:
+        parser.error('the block has no steps')
+    rate = min(max(args.rate, 1), 65535)
+    runs = [('plain', trace(steps, rate, False)), ('smoothed', trace(steps, rate, True))]
+
+    if args.csv:
+        print('mode,axis,step,time')
+        for name, (times, _, _) in runs:
+            for axis, axis_times in enumerate(times):
+                for i, t in enumerate(axis_times):
+                    print('%s,%s,%d,%.7f' % (name, AXES[axis], i + 1, t))
+        return
+
+    print('smoothing level %d at %d steps/s' % (amass_level(rate), rate))
+    for name, (times, interrupts, duration) in runs:
+        print('%-9s %6d interrupts  %8.2f ms  %6.0f interrupts/s' % (
+            name, interrupts, duration * 1000.0, interrupts / duration))
+        for axis, axis_times in enumerate(times):
+            report = axis_report(axis_times, steps[axis], duration)
+            if report is None:
+                continue
+            if len(axis_times) != steps[axis]:
+                print('  %s: %d steps instead of %d' % (AXES[axis], len(axis_times), steps[axis]))
+            print('  %s %6d steps  max error %8.1f us  interval %8.1f .. %8.1f us' % (
+                (AXES[axis], steps[axis]) + report))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,176 @@
+#!/usr/bin/env python
+""" Compares the linear (trapezoid) and the S_CURVE_ACCELERATION velocity profile of one block.
+
+The block is planned like calculate_trapezoid_for_block() does, then both ramps are cut into segments
+with the same integer math as st_prep_buffer(). The timer interval of a step is taken as
+(F_CPU/8)/rate instead of the speed_lookuptable.h interpolation, which is close enough to compare
+the shape of the profiles.
+
+Prints a summary of both profiles, or every step as CSV with --csv. Rates are in steps/s and the
+acceleration in steps/s^2. Example, a 2000 step move at 8000 steps/s entered at 1000 steps/s:
+
+  python compare_velocity_profiles.py --steps 2000 --nominal 8000 --initial 1000 --final 120 --accel 40000
+"""
+
+from __future__ import print_function
+
+import argparse
+import bisect
+import math
+
+F_CPU = 16000000
+TIMER_RATE = F_CPU / 8  # stepper timer ticks per second
+MAX_STEP_FREQUENCY = 40000
+SEGMENT_TICKS = int(2000 * TIMER_RATE / 1000000)  # SEGMENT_TIME in timer ticks
+
+
+def plan_block(steps, nominal, initial, final, accel):
+    """ Integer version of calculate_trapezoid_for_block() (FIXED_POINT_TRAPEZOID) """
+    initial = min(max(initial, 120), nominal)
+    final = min(max(final, 120), nominal)
+    twice_accel = max(accel, 1) * 2
+    accelerate = -(-(nominal * nominal - initial * initial) // twice_accel)
+    decelerate = (nominal * nominal - final * final) // twice_accel
+    plateau = steps - accelerate - decelerate
+    if plateau < 0:
+        if final >= initial:
+            rate_steps = -(-(final * final - initial * initial) // twice_accel)
+        else:
+            rate_steps = -((initial * initial - final * final) // twice_accel)
+        accelerate = min(max((steps + rate_steps + 1) >> 1, 0), steps)
+        plateau = 0
+    cruise = nominal
+    if plateau == 0:
+        cruise = min(cruise, int(math.sqrt(initial * initial + 2.0 * accel * accelerate)))
+    cruise = max(cruise, initial, final)
+    ticks_per_rate = TIMER_RATE / float(accel)
+    return {
+        'initial': initial, 'final': final, 'nominal': nominal, 'cruise': cruise,
+        'accelerate_until': accelerate, 'decelerate_after': accelerate + plateau,
+        'acceleration_rate': int(accel * (16777216.0 / TIMER_RATE)),
+        'acceleration_ticks': int((cruise - initial) * ticks_per_rate),
+        'deceleration_ticks': int((cruise - final) * ticks_per_rate),
+    }
+
+
+def s_curve_rate(tau, delta_rate):
+    """ s_curve_rate() of stepper.cpp, tau is a 0.32 fixed point fraction """
+    t = tau >> 16
+    t2 = (t * t) >> 16
+    t3 = (t2 * t) >> 16
+    s = (t3 * (10 * 65536 - 15 * t + 6 * t2)) & 0xFFFFFFFF
+    return (((s >> 16) * delta_rate) >> 16) & 0xFFFF
+
+
+def inverse(ticks):
+    return 0xFFFFFFFF // ticks if ticks else 0
+
+
+def event_ticks_for(rate):
+    """ Timer ticks per step event, step_loops and smoothing do not change that """
+    return int(TIMER_RATE / max(min(rate, MAX_STEP_FREQUENCY), 32))
+
+
+def run_block(block, steps, s_curve):
+    """ Cuts the block into segments like st_prep_buffer(), returns (time, rate) per step """
+    acc_step_rate = block['initial']
+    acceleration_time = 0
+    deceleration_time = 0
+    prepared = 0
+    time = 0.0
+    profile = []
+    while prepared < steps:
+        if prepared < block['accelerate_until']:
+            phase_end = block['accelerate_until']
+            ramp_time = acceleration_time + SEGMENT_TICKS // 2
+            if s_curve:
+                if ramp_time < block['acceleration_ticks']:
+                    tau = (ramp_time * inverse(block['acceleration_ticks'])) & 0xFFFFFFFF
+                    rate = block['initial'] + s_curve_rate(tau, block['cruise'] - block['initial'])
+                else:
+                    rate = block['cruise']
+            else:
+                rate = ((ramp_time * block['acceleration_rate']) >> 24) + block['initial']
+            rate = min(rate, block['nominal'])
+            acc_step_rate = rate
+        elif prepared >= block['decelerate_after']:
+            phase_end = steps
+            ramp_time = deceleration_time + SEGMENT_TICKS // 2
+            if s_curve:
+                if ramp_time < block['deceleration_ticks'] and acc_step_rate > block['final']:
+                    tau = (ramp_time * inverse(block['deceleration_ticks'])) & 0xFFFFFFFF
+                    rate = acc_step_rate - s_curve_rate(tau, acc_step_rate - block['final'])
+                else:
+                    rate = block['final']
+            else:
+                delta = (ramp_time * block['acceleration_rate']) >> 24
+                rate = block['final'] if delta > acc_step_rate else acc_step_rate - delta
+            rate = max(rate, block['final'])
+        else:
+            phase_end = block['decelerate_after']
+            rate = block['nominal']
+            acc_step_rate = rate
+        event_ticks = event_ticks_for(rate)
+        events = min(max(SEGMENT_TICKS // event_ticks, 1), phase_end - prepared)
+        if prepared < block['accelerate_until']:
+            acceleration_time += events * event_ticks
+        elif prepared >= block['decelerate_after']:
+            deceleration_time += events * event_ticks
+        prepared += events
+        for _ in range(events):
+            time += event_ticks / float(TIMER_RATE)
+            profile.append((time, rate))
+    return profile
+
+
+def derivative(samples):
+    """ Central difference of (time, value) pairs over a few segments and at least a few steps, which hides
+    the rate steps between the segments and the step jitter """
+    times = [t for t, _ in samples]
+    span = 4
+    reach = 2 * SEGMENT_TICKS / float(TIMER_RATE)
+    result = []
+    for i in range(len(samples)):
+        a = samples[max(min(bisect.bisect_left(times, times[i] - reach), i - span), 0)]
+        b = samples[min(max(bisect.bisect_right(times, times[i] + reach), i + span), len(samples) - 1)]
+        dt = b[0] - a[0]
+        result.append((samples[i][0], (b[1] - a[1]) / dt if dt > 0 else 0.0))
+    return result
+
+
+def summary(name, profile):
+    acceleration = derivative(profile)
+    jerk = derivative(acceleration)
+    print('%-10s time %8.2f ms  peak rate %6d  peak accel %9.0f  peak jerk %12.0f' % (
+        name, profile[-1][0] * 1000.0, max(r for _, r in profile),
+        max(abs(a) for _, a in acceleration), max(abs(j) for _, j in jerk)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--steps', type=int, default=2000, help='step_event_count of the block')
+    parser.add_argument('--nominal', type=int, default=8000, help='nominal_rate in steps/s')
+    parser.add_argument('--initial', type=int, default=120, help='entry rate in steps/s')
+    parser.add_argument('--final', type=int, default=120, help='exit rate in steps/s')
+    parser.add_argument('--accel', type=int, default=40000, help='acceleration_st in steps/s^2')
+    parser.add_argument('--csv', action='store_true', help='print every step instead of the summary')
+    args = parser.parse_args()
+
+    block = plan_block(args.steps, min(args.nominal, 65535), args.initial, args.final, args.accel)
+    linear = run_block(block, args.steps, False)
+    s_curve = run_block(block, args.steps, True)
+
+    if args.csv:
+        print('step,linear_time,linear_rate,s_curve_time,s_curve_rate')
+        for i, (l, s) in enumerate(zip(linear, s_curve)):
+            print('%d,%.6f,%d,%.6f,%d' % (i + 1, l[0], l[1], s[0], s[1]))
+        return
+
+    print('accelerate_until %d  decelerate_after %d  cruise rate %d' % (
+        block['accelerate_until'], block['decelerate_after'], block['cruise']))
+    summary('linear', linear)
+    summary('s-curve', s_curve)
+
+
+if __name__ == '__main__':
+    main()
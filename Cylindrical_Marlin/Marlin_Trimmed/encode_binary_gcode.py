@@ -0,0 +1,141 @@
+#!/usr/bin/env python
+""" Converts a G-code file to the binary frames of BINARY_PROTOCOL.
+
+G0, G1 and G92 with nothing but X Y Z E F become move and set position frames with the coordinates in
+fixed point, every other command goes in a text frame. Comments, line numbers and checksums are left
+out, the frames are numbered from --first-line on like the N of the lines a host would send. The frame
+layout is described in gcode.h.
+
+Prints how many bytes the frames take next to the same commands as lines with N and *. Example:
+
+  python encode_binary_gcode.py scaffold.gcode scaffold.bin
+"""
+
+from __future__ import print_function
+
+import argparse
+import math
+import re
+import struct
+import sys
+
+FRAME_START = 0xA5
+ESCAPE = 0x7D
+ESCAPE_XOR = 0x20
+# Sent as ESCAPE and the byte XOR ESCAPE_XOR behind the start byte: the start byte, ESCAPE and the
+# FEED_HOLD_CHAR and CYCLE_START_CHAR that the serial interrupt takes out of the stream
+STUFFED = (FRAME_START, ESCAPE, ord('!'), ord('~'))
+OP_MOVE = 1
+OP_SET_POSITION = 2
+OP_TEXT = 3
+AXES = 'XYZEF'
+SCALE = 10000.0
+MAX_CMD_SIZE = 96
+MAX_PAYLOAD = MAX_CMD_SIZE - 5 - 2  # BINARY_MAX_PAYLOAD of Marlin_main.cpp
+
+WORD = re.compile(r'([A-Z])\s*([-+]?(?:\d+\.?\d*|\.\d+))?')
+
+
+def crc16(data, crc=0xFFFF):
+    """ CRC16 like _crc_ccitt_update() of avr-libc """
+    for byte in bytearray(data):
+        byte ^= crc & 0xFF
+        byte = (byte ^ (byte << 4)) & 0xFF
+        crc = ((byte << 8) | (crc >> 8)) ^ (byte >> 4) ^ (byte << 3)
+    return crc & 0xFFFF
+
+
+def frame(opcode, line, payload):
+    body = struct.pack('<BBH', opcode, len(payload), line & 0xFFFF) + payload
+    body += struct.pack('<H', crc16(body))
+    stuffed = bytearray([FRAME_START])
+    for byte in bytearray(body):
+        if byte in STUFFED:
+            stuffed += bytearray([ESCAPE, byte ^ ESCAPE_XOR])
+        else:
+            stuffed.append(byte)
+    return stuffed
+
+
+def clean(text):
+    """ Returns the command without comment, line number and checksum """
+    text = text.split(';', 1)[0].split('*', 1)[0].strip()
+    return re.sub(r'^N\s*\d+\s*', '', text)
+
+
+def move_payload(command):
+    """ Returns (opcode, payload) if the command fits a move frame, None if it has to be text """
+    words = WORD.findall(command)
+    if ''.join(letter + number for letter, number in words) != command.replace(' ', ''):
+        return None  # Something the words do not cover, like lower case or text
+    if not words or words[0][0] != 'G' or words[0][1] not in ('0', '1', '92'):
+        return None
+    opcode = OP_SET_POSITION if words[0][1] == '92' else OP_MOVE
+    values = {}
+    for letter, number in words[1:]:
+        if letter not in AXES or letter in values or not number:
+            return None
+        fixed = int(math.floor(float(number) * SCALE + 0.5))
+        if not -2 ** 31 <= fixed < 2 ** 31:
+            return None
+        values[letter] = fixed
+    if opcode == OP_SET_POSITION and not values:
+        return None  # G92 alone is not a set position frame, it goes as text
+    mask = 0
+    payload = b''
+    for i, axis in enumerate(AXES):
+        if axis in values:
+            mask |= 1 << i
+            payload += struct.pack('<i', values[axis])
+    return opcode, struct.pack('<B', mask) + payload
+
+
+def ascii_size(command, line):
+    """ Bytes of the command sent as a line with N and checksum """
+    text = 'N%d %s' % (line, command)
+    checksum = 0
+    for c in bytearray(text.encode('ascii')):
+        checksum ^= c
+    return len('%s*%d\n' % (text, checksum))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('gcode', help='G-code file to convert')
+    parser.add_argument('output', help='file for the frames')
+    parser.add_argument('--first-line', type=int, default=1,
+                        help='line number of the first frame, one past the last line the printer got')
+    args = parser.parse_args()
+
+    line = args.first_line
+    frames = bytearray()
+    ascii_bytes = 0
+    counts = {OP_MOVE: 0, OP_SET_POSITION: 0, OP_TEXT: 0}
+    with open(args.gcode) as f:
+        for number, text in enumerate(f, 1):
+            command = clean(text)
+            if not command:
+                continue
+            encoded = move_payload(command)
+            if encoded is None:
+                if len(command) > MAX_PAYLOAD:
+                    sys.exit('%s:%d: command longer than %d characters' % (args.gcode, number, MAX_PAYLOAD))
+                encoded = (OP_TEXT, command.encode('ascii'))
+            frames += frame(encoded[0], line, encoded[1])
+            counts[encoded[0]] += 1
+            ascii_bytes += ascii_size(command, line)
+            line += 1
+
+    with open(args.output, 'wb') as f:
+        f.write(frames)
+
+    total = sum(counts.values())
+    print('%d commands: %d moves, %d set positions, %d text' %
+          (total, counts[OP_MOVE], counts[OP_SET_POSITION], counts[OP_TEXT]))
+    print('%d bytes as frames, %d bytes as lines with N and *' % (len(frames), ascii_bytes))
+    if ascii_bytes:
+        print('%.1f%% of the serial bytes' % (100.0 * len(frames) / ascii_bytes))
+
+
+if __name__ == '__main__':
+    main()
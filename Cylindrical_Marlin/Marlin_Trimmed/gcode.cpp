@@ -0,0 +1,191 @@
+/*
+  gcode.cpp - splits a G-code command into its parameters in a single pass
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Marlin.h"
+#include "gcode.h"
+
+#ifdef BINARY_PROTOCOL
+  #include <util/crc16.h>
+#endif
+
+GCodeParser parser;
+
+char *GCodeParser::command_ptr;
+uint32_t GCodeParser::codebits;
+char *GCodeParser::value_ptr;
+char GCodeParser::command_letter;
+uint8_t GCodeParser::param[26];
+float GCodeParser::value[GCODE_MAX_PARAMS];
+uint8_t GCodeParser::offset[GCODE_MAX_PARAMS];
+uint8_t GCodeParser::value_index;
+#ifdef BINARY_PROTOCOL
+  bool GCodeParser::binary;
+#endif
+
+void GCodeParser::parse(char *p)
+{
+  command_ptr = p;
+  value_ptr = p;
+  codebits = 0;
+  command_letter = 0;
+  memset(param, 0, sizeof(param));
+  #ifdef BINARY_PROTOCOL
+    binary = false;
+  #endif
+
+  uint8_t count = 0;
+  for (char *s = p; *s; s++) {
+    uint8_t ind = *s - 'A';
+    if (ind >= 26 || param[ind]) continue; // Not a parameter, or not the first one of its letter
+    if (count >= GCODE_MAX_PARAMS) break;
+    codebits |= 1UL << ind;
+    offset[count] = s - p;
+    value[count] = parse_float(s + 1);
+    param[ind] = ++count;
+    if (!command_letter && *s != 'N') command_letter = *s;
+  }
+}
+
+#ifdef BINARY_PROTOCOL
+bool GCodeParser::binary_frame_valid(const char *frame)
+{
+  uint8_t length = frame[2];
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 1; i < BINARY_HEADER_SIZE + length; i++) crc = _crc_ccitt_update(crc, frame[i]);
+  const uint8_t *end = (const uint8_t *)frame + BINARY_HEADER_SIZE + length;
+  if (crc != (end[0] | (end[1] << 8))) return false;
+
+  switch (frame[1]) {
+    case BINARY_OP_MOVE:
+    case BINARY_OP_SET_POSITION: {
+      uint8_t mask = frame[BINARY_HEADER_SIZE];
+      if (length == 0 || (mask >> (sizeof(BINARY_AXES) - 1))) return false;
+      uint8_t expected = 1;
+      for (; mask; mask >>= 1) if (mask & 1) expected += 4;
+      return length == expected;
+    }
+    case BINARY_OP_TEXT:
+      return length > 0;
+    default:
+      return false;
+  }
+}
+
+// The frame stays where it is, the parameters are looked up in it like in a G-code line. The
+// coordinates are only converted to float, there are no digits to go through.
+void GCodeParser::parse_binary(char *frame)
+{
+  command_ptr = frame;
+  value_ptr = frame;
+  codebits = GCODE_BIT('G');
+  command_letter = 'G';
+  memset(param, 0, sizeof(param));
+  binary = true;
+
+  offset[0] = 0;
+  value[0] = (frame[1] == BINARY_OP_MOVE) ? 1 : 92;
+  param['G' - 'A'] = 1;
+
+  uint8_t count = 1;
+  uint8_t mask = frame[BINARY_HEADER_SIZE];
+  const char *p = frame + BINARY_HEADER_SIZE + 1;
+  for (uint8_t i = 0; mask; i++, mask >>= 1) {
+    if (!(mask & 1)) continue;
+    int32_t fixed;
+    memcpy(&fixed, p, sizeof(fixed)); // Little endian like the AVR
+    p += sizeof(fixed);
+    uint8_t ind = BINARY_AXES[i] - 'A';
+    codebits |= 1UL << ind;
+    offset[count] = 0;
+    value[count] = fixed / BINARY_SCALE;
+    param[ind] = ++count;
+  }
+}
+#endif
+
+// Powers of ten for the fraction, a longer fraction is scaled down in steps of 10^9
+static const float fraction_scale[] PROGMEM = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f };
+
+float GCodeParser::parse_float(const char *s)
+{
+  while (*s == ' ') s++;
+  bool negative = (*s == '-');
+  if (negative || *s == '+') s++;
+
+  // The digits are collected in a 32 bit integer, digits that do not fit any more only move the
+  // decimal point. That keeps more precision than a float has.
+  uint32_t digits = 0;
+  int8_t exponent = 0;
+  uint8_t d;
+  while ((d = *s - '0') <= 9) {
+    if (digits < 429496729UL) digits = digits * 10 + d;
+    else if (exponent < 100) exponent++;
+    s++;
+  }
+  if (*s == '.') {
+    s++;
+    while ((d = *s - '0') <= 9) {
+      if (digits < 429496729UL && exponent > -100) {
+        digits = digits * 10 + d;
+        exponent--;
+      }
+      s++;
+    }
+  }
+
+  float result = digits;
+  while (exponent < -9) {
+    result /= pgm_read_float_near(&fraction_scale[9]);
+    exponent += 9;
+  }
+  if (exponent < 0) result /= pgm_read_float_near(&fraction_scale[-exponent]);
+  while (exponent > 0) {
+    result *= 10;
+    exponent--;
+  }
+  return negative ? -result : result;
+}
+
+long GCodeParser::parse_long(const char *s)
+{
+  while (*s == ' ') s++;
+  bool negative = (*s == '-');
+  if (negative || *s == '+') s++;
+
+  unsigned long result = 0;
+  uint8_t d;
+  while ((d = *s - '0') <= 9) {
+    result = result * 10 + d;
+    s++;
+  }
+  return negative ? -(long)result : (long)result;
+}
+
+#ifdef DEBUG_GCODE_PARSER
+void GCodeParser::debug()
+{
+  SERIAL_ECHOPGM("Command: ");
+  SERIAL_ECHO(command_ptr);
+  for (char c = 'A'; c <= 'Z'; c++) {
+    if (!param[c - 'A']) continue;
+    SERIAL_ECHOPGM(" ");
+    SERIAL_ECHO(c);
+    SERIAL_ECHO(value[param[c - 'A'] - 1]);
+  }
+  SERIAL_ECHOLNPGM("");
+}
+#endif
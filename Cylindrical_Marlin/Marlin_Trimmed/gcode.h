@@ -0,0 +1,117 @@
+/*
+  gcode.h - splits a G-code command into its parameters in a single pass
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCODE_H
+#define GCODE_H
+
+#include <stdint.h>
+
+// Parameters with a value per command. Letters past that are not seen, commands that take text like
+// M117 are read from the command itself.
+#ifndef GCODE_MAX_PARAMS
+  #define GCODE_MAX_PARAMS 12
+#endif
+
+#define GCODE_BIT(letter) (1UL << ((letter) - 'A'))
+
+#ifdef BINARY_PROTOCOL
+  // A binary frame is the start byte, the opcode, the payload length, the sequence number (the low 16
+  // bits of the line number) and the payload, followed by a CRC16 of everything from the opcode on.
+  // Numbers are little endian. The start byte is above ASCII, so no G-code line starts with it.
+  #define BINARY_FRAME_START 0xA5
+  #define BINARY_HEADER_SIZE 5
+  #define BINARY_CRC_SIZE 2
+
+  // Behind the start byte, the start byte itself, BINARY_ESCAPE, FEED_HOLD_CHAR and CYCLE_START_CHAR
+  // are sent as BINARY_ESCAPE and the byte XOR BINARY_ESCAPE_XOR. So a start byte always begins a new
+  // frame, and the serial interrupt takes no frame byte for a realtime command. Length and CRC are of
+  // the bytes before stuffing.
+  #define BINARY_ESCAPE 0x7D
+  #define BINARY_ESCAPE_XOR 0x20
+
+  // Move and set position take a mask of BINARY_AXES as the payload, then an int32 in 1/BINARY_SCALE
+  // mm (mm/min for F) for each axis in the mask. Text is any other command as G-code, without N and *.
+  #define BINARY_OP_MOVE 1          // G1
+  #define BINARY_OP_SET_POSITION 2  // G92
+  #define BINARY_OP_TEXT 3
+  #define BINARY_AXES "XYZEF"
+  #define BINARY_SCALE 10000.0
+#endif
+
+// parse() walks the command once. Every upper case letter is a parameter and the number behind it its
+// value, a letter that shows up twice keeps the first value like strchr() used to find it. Looking up
+// a parameter afterwards costs no scanning: seen() checks the letter and selects it, value_float() and
+// friends return the value of the selected letter.
+class GCodeParser
+{
+  public:
+    static char *command_ptr;               // The command parse() was given
+    static uint32_t codebits;               // GCODE_BIT() of every letter in the command
+    static char *value_ptr;                 // Text behind the letter selected by seen()
+    static char command_letter;             // G, M, T or B of the command, the first letter after N. 0 if none
+
+    static void parse(char *p);
+
+    #ifdef BINARY_PROTOCOL
+      static bool binary_frame_valid(const char *frame); // CRC and payload of a complete frame
+      static void parse_binary(char *frame);             // A move or set position frame
+    #endif
+
+    // True if the letter is in the command, it is selected for the value_*() getters then
+    static bool seen(const char c)
+    {
+      uint8_t ind = c - 'A';
+      if (ind >= 26 || !param[ind]) return false;
+      value_index = param[ind] - 1;
+      value_ptr = command_ptr + offset[value_index] + 1;
+      return true;
+    }
+
+    // True if any of the letters in mask, a set of GCODE_BIT(), is in the command
+    static bool seen_any(const uint32_t mask) { return (codebits & mask) != 0; }
+
+    static float value_float() { return value[value_index]; }
+    static long value_long()                // Floats are exact only up to 2^24
+    {
+      #ifdef BINARY_PROTOCOL
+        if (binary) return value[value_index] < 0 ? value[value_index] - 0.5 : value[value_index] + 0.5;
+      #endif
+      return parse_long(value_ptr);
+    }
+
+    // Numbers the way G-code writes them: leading spaces, a sign, digits and a fraction, no exponent.
+    // They stop at the first other character like strtod() and strtol(), at a fraction of the cost.
+    static float parse_float(const char *s);
+    static long parse_long(const char *s);
+
+    #ifdef DEBUG_GCODE_PARSER
+      static void debug();                  // Prints the parameters of the command
+    #endif
+
+  private:
+    static uint8_t param[26];               // Per letter 1 + its index in value[], 0 if not seen
+    static float value[GCODE_MAX_PARAMS];   // The values in the order of the letters
+    static uint8_t offset[GCODE_MAX_PARAMS]; // Where the letter of each value is in the command
+    static uint8_t value_index;             // Selected by seen()
+    #ifdef BINARY_PROTOCOL
+      static bool binary;                   // The values came from a frame, there is no text behind them
+    #endif
+};
+
+extern GCodeParser parser;
+
+#endif // GCODE_H
@@ -181,6 +181,7 @@
 	#define MSG_ERR_CHECKSUM_MISMATCH "checksum mismatch, Last Line: "
 	#define MSG_ERR_NO_CHECKSUM "No Checksum with line number, Last Line: "
 	#define MSG_ERR_NO_LINENUMBER_WITH_CHECKSUM "No Line Number with checksum, Last Line: "
+	#define MSG_ERR_BINARY_FRAME "Bad binary frame, Last Line: "
 	#define MSG_FILE_PRINTED "Done printing file"
 	#define MSG_BEGIN_FILE_LIST "Begin file list"
 	#define MSG_END_FILE_LIST "End file list"
@@ -232,6 +233,7 @@
 
 	#define MSG_STEPPER_TOO_HIGH "Steprate too high: "
 	#define MSG_ENDSTOPS_HIT "endstops hit: "
+	#define MSG_FEED_HOLD "Feed hold"
 	#define MSG_ERR_COLD_EXTRUDE_STOP " cold extrusion prevented"
 	#define MSG_ERR_LONG_EXTRUDE_STOP " too long extrusion prevented"
 	#define MSG_BABYSTEPPING_X "Babystepping X"
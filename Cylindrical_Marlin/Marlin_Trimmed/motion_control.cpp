@@ -22,116 +22,277 @@
 #include "Marlin.h"
 #include "stepper.h"
 #include "planner.h"
+#include "motion_control.h"
+
+// The arc in progress. It is kept between calls so the arc can be continued when the planner
+// had no room left for the next segment.
+static uint16_t arc_segments = 0;   // Number of segments of the arc in progress, 0 when there is none
+static uint16_t arc_segment;        // Index of the next segment to buffer
+static int8_t arc_count;            // Segments since the last arc correction
+static uint8_t arc_axis_0, arc_axis_1, arc_axis_linear, arc_extruder;
+static float arc_center_axis0, arc_center_axis1;
+static float arc_offset_axis0, arc_offset_axis1;
+static float arc_r_axis0, arc_r_axis1;  // Radius vector from center to the last generated segment
+static float arc_theta_per_segment, arc_linear_per_segment, arc_extruder_per_segment;
+static float arc_cos_T, arc_sin_T;
+static float arc_feed_rate;
+static float arc_target[4];         // Last generated segment
+static float arc_end[4];
+
+// Generates the point of segment arc_segment and moves on to the next one
+static void arc_next_point(float *point)
+{
+  if (arc_segment == arc_segments) {
+    // Ensure last segment arrives at target location.
+    memcpy(point, arc_end, sizeof(arc_end));
+    arc_segment++;
+    return;
+  }
+
+  if (arc_count < N_ARC_CORRECTION) {
+    // Apply vector rotation matrix 
+    float r_axisi = arc_r_axis0*arc_sin_T + arc_r_axis1*arc_cos_T;
+    arc_r_axis0 = arc_r_axis0*arc_cos_T - arc_r_axis1*arc_sin_T;
+    arc_r_axis1 = r_axisi;
+    arc_count++;
+  } else {
+    // Arc correction to radius vector. Computed only every N_ARC_CORRECTION increments.
+    // Compute exact location by applying transformation matrix from initial radius vector(=-offset).
+    float cos_Ti = cos(arc_segment*arc_theta_per_segment);
+    float sin_Ti = sin(arc_segment*arc_theta_per_segment);
+    arc_r_axis0 = -arc_offset_axis0*cos_Ti + arc_offset_axis1*sin_Ti;
+    arc_r_axis1 = -arc_offset_axis0*sin_Ti - arc_offset_axis1*cos_Ti;
+    arc_count = 0;
+  }
+
+  // Update arc_target location
+  arc_target[arc_axis_0] = arc_center_axis0 + arc_r_axis0;
+  arc_target[arc_axis_1] = arc_center_axis1 + arc_r_axis1;
+  arc_target[arc_axis_linear] += arc_linear_per_segment;
+  arc_target[E_AXIS] += arc_extruder_per_segment;
+
+  clamp_to_software_endstops(arc_target);
+  memcpy(point, arc_target, sizeof(arc_target));
+  arc_segment++;
+}
 
 // The arc is approximated by generating a huge number of tiny, linear segments. The length of each 
 // segment is configured in settings.mm_per_arc_segment.  
-void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8_t axis_1, 
+bool mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8_t axis_1, 
   uint8_t axis_linear, float feed_rate, float radius, uint8_t isclockwise, uint8_t extruder)
 {      
   //   int acceleration_manager_was_enabled = plan_is_acceleration_manager_enabled();
   //   plan_set_acceleration_manager_enabled(false); // disable acceleration management for the duration of the arc
-  float center_axis0 = position[axis_0] + offset[axis_0];
-  float center_axis1 = position[axis_1] + offset[axis_1];
-  float linear_travel = target[axis_linear] - position[axis_linear];
-  float extruder_travel = target[E_AXIS] - position[E_AXIS];
-  float r_axis0 = -offset[axis_0];  // Radius vector from center to current location
-  float r_axis1 = -offset[axis_1];
-  float rt_axis0 = target[axis_0] - center_axis0;
-  float rt_axis1 = target[axis_1] - center_axis1;
-  
-  // CCW angle between position and target from circle center. Only one atan2() trig computation required.
-  float angular_travel = atan2(r_axis0*rt_axis1-r_axis1*rt_axis0, r_axis0*rt_axis0+r_axis1*rt_axis1);
-  if (angular_travel < 0) { angular_travel += 2*M_PI; }
-  if (isclockwise) { angular_travel -= 2*M_PI; }
-  
-  float millimeters_of_travel = hypot(angular_travel*radius, fabs(linear_travel));
-  if (millimeters_of_travel < 0.001) { return; }
-  uint16_t segments = floor(millimeters_of_travel/MM_PER_ARC_SEGMENT);
-  if(segments == 0) segments = 1;
-  
-  /*  
-    // Multiply inverse feed_rate to compensate for the fact that this movement is approximated
-    // by a number of discrete segments. The inverse feed_rate should be correct for the sum of 
-    // all segments.
-    if (invert_feed_rate) { feed_rate *= segments; }
-  */
-  float theta_per_segment = angular_travel/segments;
-  float linear_per_segment = linear_travel/segments;
-  float extruder_per_segment = extruder_travel/segments;
-  
-  /* Vector rotation by transformation matrix: r is the original vector, r_T is the rotated vector,
-     and phi is the angle of rotation. Based on the solution approach by Jens Geisler.
-         r_T = [cos(phi) -sin(phi);
-                sin(phi)  cos(phi] * r ;
-     
-     For arc generation, the center of the circle is the axis of rotation and the radius vector is 
-     defined from the circle center to the initial position. Each line segment is formed by successive
-     vector rotations. This requires only two cos() and sin() computations to form the rotation
-     matrix for the duration of the entire arc. Error may accumulate from numerical round-off, since
-     all double numbers are single precision on the Arduino. (True double precision will not have
-     round off issues for CNC applications.) Single precision error can accumulate to be greater than
-     tool precision in some cases. Therefore, arc path correction is implemented. 
-
-     Small angle approximation may be used to reduce computation overhead further. This approximation
-     holds for everything, but very small circles and large mm_per_arc_segment values. In other words,
-     theta_per_segment would need to be greater than 0.1 rad and N_ARC_CORRECTION would need to be large
-     to cause an appreciable drift error. N_ARC_CORRECTION~=25 is more than small enough to correct for 
-     numerical drift error. N_ARC_CORRECTION may be on the order a hundred(s) before error becomes an
-     issue for CNC machines with the single precision Arduino calculations.
-     
-     This approximation also allows mc_arc to immediately insert a line segment into the planner 
-     without the initial overhead of computing cos() or sin(). By the time the arc needs to be applied
-     a correction, the planner should have caught up to the lag caused by the initial mc_arc overhead. 
-     This is important when there are successive arc motions. 
-  */
-  // Vector rotation matrix values
-  float cos_T = 1-0.5*theta_per_segment*theta_per_segment; // Small angle approximation
-  float sin_T = theta_per_segment;
-  
-  float arc_target[4];
-  float sin_Ti;
-  float cos_Ti;
-  float r_axisi;
-  uint16_t i;
-  int8_t count = 0;
-
-  // Initialize the linear axis
-  arc_target[axis_linear] = position[axis_linear];
-  
-  // Initialize the extruder axis
-  arc_target[E_AXIS] = position[E_AXIS];
-
-  for (i = 1; i<segments; i++) { // Increment (segments-1)
+  if (arc_segments == 0) {
+    float center_axis0 = position[axis_0] + offset[axis_0];
+    float center_axis1 = position[axis_1] + offset[axis_1];
+    float linear_travel = target[axis_linear] - position[axis_linear];
+    float extruder_travel = target[E_AXIS] - position[E_AXIS];
+    float r_axis0 = -offset[axis_0];  // Radius vector from center to current location
+    float r_axis1 = -offset[axis_1];
+    float rt_axis0 = target[axis_0] - center_axis0;
+    float rt_axis1 = target[axis_1] - center_axis1;
     
-    if (count < N_ARC_CORRECTION) {
-      // Apply vector rotation matrix 
-      r_axisi = r_axis0*sin_T + r_axis1*cos_T;
-      r_axis0 = r_axis0*cos_T - r_axis1*sin_T;
-      r_axis1 = r_axisi;
-      count++;
-    } else {
-      // Arc correction to radius vector. Computed only every N_ARC_CORRECTION increments.
-      // Compute exact location by applying transformation matrix from initial radius vector(=-offset).
-      cos_Ti = cos(i*theta_per_segment);
-      sin_Ti = sin(i*theta_per_segment);
-      r_axis0 = -offset[axis_0]*cos_Ti + offset[axis_1]*sin_Ti;
-      r_axis1 = -offset[axis_0]*sin_Ti - offset[axis_1]*cos_Ti;
-      count = 0;
-    }
+    // CCW angle between position and target from circle center. Only one atan2() trig computation required.
+    float angular_travel = atan2(r_axis0*rt_axis1-r_axis1*rt_axis0, r_axis0*rt_axis0+r_axis1*rt_axis1);
+    if (angular_travel < 0) { angular_travel += 2*M_PI; }
+    if (isclockwise) { angular_travel -= 2*M_PI; }
+    
+    float millimeters_of_travel = hypot(angular_travel*radius, fabs(linear_travel));
+    if (millimeters_of_travel < 0.001) { return true; }
+    uint16_t segments = floor(millimeters_of_travel/MM_PER_ARC_SEGMENT);
+    if(segments == 0) segments = 1;
+    
+    /*  
+      // Multiply inverse feed_rate to compensate for the fact that this movement is approximated
+      // by a number of discrete segments. The inverse feed_rate should be correct for the sum of 
+      // all segments.
+      if (invert_feed_rate) { feed_rate *= segments; }
+    */
+    arc_theta_per_segment = angular_travel/segments;
+    arc_linear_per_segment = linear_travel/segments;
+    arc_extruder_per_segment = extruder_travel/segments;
+    
+    /* Vector rotation by transformation matrix: r is the original vector, r_T is the rotated vector,
+       and phi is the angle of rotation. Based on the solution approach by Jens Geisler.
+           r_T = [cos(phi) -sin(phi);
+                  sin(phi)  cos(phi] * r ;
+       
+       For arc generation, the center of the circle is the axis of rotation and the radius vector is 
+       defined from the circle center to the initial position. Each line segment is formed by successive
+       vector rotations. This requires only two cos() and sin() computations to form the rotation
+       matrix for the duration of the entire arc. Error may accumulate from numerical round-off, since
+       all double numbers are single precision on the Arduino. (True double precision will not have
+       round off issues for CNC applications.) Single precision error can accumulate to be greater than
+       tool precision in some cases. Therefore, arc path correction is implemented. 
 
-    // Update arc_target location
-    arc_target[axis_0] = center_axis0 + r_axis0;
-    arc_target[axis_1] = center_axis1 + r_axis1;
-    arc_target[axis_linear] += linear_per_segment;
-    arc_target[E_AXIS] += extruder_per_segment;
+       Small angle approximation may be used to reduce computation overhead further. This approximation
+       holds for everything, but very small circles and large mm_per_arc_segment values. In other words,
+       theta_per_segment would need to be greater than 0.1 rad and N_ARC_CORRECTION would need to be large
+       to cause an appreciable drift error. N_ARC_CORRECTION~=25 is more than small enough to correct for 
+       numerical drift error. N_ARC_CORRECTION may be on the order a hundred(s) before error becomes an
+       issue for CNC machines with the single precision Arduino calculations.
+       
+       This approximation also allows mc_arc to immediately insert a line segment into the planner 
+       without the initial overhead of computing cos() or sin(). By the time the arc needs to be applied
+       a correction, the planner should have caught up to the lag caused by the initial mc_arc overhead. 
+       This is important when there are successive arc motions. 
+    */
+    // Vector rotation matrix values
+    arc_cos_T = 1-0.5*arc_theta_per_segment*arc_theta_per_segment; // Small angle approximation
+    arc_sin_T = arc_theta_per_segment;
 
-    clamp_to_software_endstops(arc_target);
-    plan_buffer_line(arc_target[X_AXIS], arc_target[Y_AXIS], arc_target[Z_AXIS], arc_target[E_AXIS], feed_rate, extruder);
+    arc_axis_0 = axis_0;
+    arc_axis_1 = axis_1;
+    arc_axis_linear = axis_linear;
+    arc_extruder = extruder;
+    arc_feed_rate = feed_rate;
+    arc_center_axis0 = center_axis0;
+    arc_center_axis1 = center_axis1;
+    arc_offset_axis0 = offset[axis_0];
+    arc_offset_axis1 = offset[axis_1];
+    arc_r_axis0 = r_axis0;
+    arc_r_axis1 = r_axis1;
+    memcpy(arc_end, target, sizeof(arc_end));
+
+    // Initialize the linear axis
+    arc_target[axis_linear] = position[axis_linear];
     
+    // Initialize the extruder axis
+    arc_target[E_AXIS] = position[E_AXIS];
+
+    arc_count = 0;
+    arc_segment = 1;
+    arc_segments = segments;
   }
-  // Ensure last segment arrives at target location.
-  plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], target[E_AXIS], feed_rate, extruder);
+
+  // The segments are generated in batches no larger than the free room in the planner. Should the
+  // planner take fewer anyway, the arc goes back to the first point it did not take.
+  while (arc_segment <= arc_segments) {
+    float points[N_ARC_SEGMENTS_PER_BATCH][NUM_AXIS];
+    uint8_t batch = min(BLOCK_BUFFER_SIZE - 1 - movesplanned(), N_ARC_SEGMENTS_PER_BATCH);
+    if (batch == 0) { return false; }
+
+    uint16_t start_segment = arc_segment;
+    int8_t start_count = arc_count;
+    float start_r_axis0 = arc_r_axis0, start_r_axis1 = arc_r_axis1;
+    float start_target[4];
+    memcpy(start_target, arc_target, sizeof(arc_target));
+
+    uint8_t n;
+    for (n = 0; n < batch && arc_segment <= arc_segments; n++) {
+      arc_next_point(points[n]);
+    }
+    uint8_t queued = plan_try_buffer_polyline(points, n, arc_feed_rate, arc_extruder);
+    if (queued < n) {
+      arc_segment = start_segment;
+      arc_count = start_count;
+      arc_r_axis0 = start_r_axis0;
+      arc_r_axis1 = start_r_axis1;
+      memcpy(arc_target, start_target, sizeof(arc_target));
+      while (queued--) { arc_next_point(points[0]); }
+      return false;
+    }
+  }
+  arc_segments = 0;
 
   //   plan_set_acceleration_manager_enabled(acceleration_manager_was_enabled);
+  return true;
+}
+
+void mc_arc_abort()
+{
+  arc_segments = 0;
+}
+
+#ifdef SEGMENT_COALESCING
+// The held back move, to be extended by the following moves as long as they are collinear with it
+static bool coalesce_pending = false;
+static float coalesce_start[NUM_AXIS];
+static float coalesce_end[NUM_AXIS];
+static float coalesce_feed_rate;
+static uint8_t coalesce_extruder;
+static float coalesce_deviation;  // Sum of the chord errors of the points merged so far, bounds the total error
+
+// Checks if the move from coalesce_end to target can be merged into the held back move. If so,
+// deviation is set to the chord error of the merged move.
+static bool coalesce_mergeable(float *target, float feed_rate, uint8_t extruder, float &deviation)
+{
+  if (feed_rate != coalesce_feed_rate || extruder != coalesce_extruder) { return false; }
+  if (movesplanned() <= COALESCE_MIN_PLANNED) { return false; } // Keep the planner fed instead
+
+  float u[3], v[3], w[3];  // held back move, new move, merged move
+  for (uint8_t i = 0; i < 3; i++) {
+    u[i] = coalesce_end[i] - coalesce_start[i];
+    v[i] = target[i] - coalesce_end[i];
+    w[i] = target[i] - coalesce_start[i];
+  }
+  // The new move has to continue forward
+  if (u[X_AXIS]*v[X_AXIS] + u[Y_AXIS]*v[Y_AXIS] + u[Z_AXIS]*v[Z_AXIS] <= 0.0) { return false; }
+
+  float u_length = sqrt(square(u[X_AXIS]) + square(u[Y_AXIS]) + square(u[Z_AXIS]));
+  float v_length = sqrt(square(v[X_AXIS]) + square(v[Y_AXIS]) + square(v[Z_AXIS]));
+  float w_length = sqrt(square(w[X_AXIS]) + square(w[Y_AXIS]) + square(w[Z_AXIS]));
+
+  // Equal extrusion per mm, so E stays linear along the merged move
+  float u_ratio = (coalesce_end[E_AXIS] - coalesce_start[E_AXIS]) / u_length;
+  float v_ratio = (target[E_AXIS] - coalesce_end[E_AXIS]) / v_length;
+  if (fabs(u_ratio - v_ratio) > COALESCE_EXTRUSION_TOLERANCE * max(fabs(u_ratio), fabs(v_ratio))) { return false; }
+
+  // Distance of the current end point from the merged move: |u x w| / |w|
+  float cross_x = u[Y_AXIS]*w[Z_AXIS] - u[Z_AXIS]*w[Y_AXIS];
+  float cross_y = u[Z_AXIS]*w[X_AXIS] - u[X_AXIS]*w[Z_AXIS];
+  float cross_z = u[X_AXIS]*w[Y_AXIS] - u[Y_AXIS]*w[X_AXIS];
+  deviation = coalesce_deviation + sqrt(square(cross_x) + square(cross_y) + square(cross_z)) / w_length;
+  return deviation <= COALESCE_CHORD_TOLERANCE;
+}
+#endif
+
+bool mc_line(float *position, float *target, float feed_rate, uint8_t extruder)
+{
+#ifdef SEGMENT_COALESCING
+  if (coalesce_pending) {
+    float deviation;
+    if (coalesce_mergeable(target, feed_rate, extruder, deviation)) {
+      memcpy(coalesce_end, target, sizeof(coalesce_end));
+      coalesce_deviation = deviation;
+      return true;
+    }
+    if (!mc_line_flush()) { return false; }
+  }
+
+  // Hold back moves with XYZ travel, extruder only moves go straight to the planner
+  if ((position[X_AXIS] != target[X_AXIS] || position[Y_AXIS] != target[Y_AXIS] || position[Z_AXIS] != target[Z_AXIS])
+    && movesplanned() > COALESCE_MIN_PLANNED) {
+    memcpy(coalesce_start, position, sizeof(coalesce_start));
+    memcpy(coalesce_end, target, sizeof(coalesce_end));
+    coalesce_feed_rate = feed_rate;
+    coalesce_extruder = extruder;
+    coalesce_deviation = 0.0;
+    coalesce_pending = true;
+    return true;
+  }
+#endif
+  return plan_try_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], target[E_AXIS], feed_rate, extruder);
+}
+
+bool mc_line_flush()
+{
+#ifdef SEGMENT_COALESCING
+  if (coalesce_pending) {
+    if (!plan_try_buffer_line(coalesce_end[X_AXIS], coalesce_end[Y_AXIS], coalesce_end[Z_AXIS], coalesce_end[E_AXIS], coalesce_feed_rate, coalesce_extruder)) {
+      return false;
+    }
+    coalesce_pending = false;
+  }
+#endif
+  return true;
+}
+
+void mc_line_discard()
+{
+#ifdef SEGMENT_COALESCING
+  coalesce_pending = false;
+#endif
 }
 
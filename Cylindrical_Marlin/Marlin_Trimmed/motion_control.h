@@ -26,7 +26,24 @@
 // offset == offset from current xyz, axis_XXX defines circle plane in tool space, axis_linear is
 // the direction of helical travel, radius == circle radius, isclockwise boolean. Used
 // for vector transformation direction.
-void mc_arc(float *position, float *target, float *offset, unsigned char axis_0, unsigned char axis_1,
+// Buffers as many segments as the planner has room for. Returns false if the arc is not finished yet,
+// call again with the same arguments to continue it; they are only read when a new arc starts.
+bool mc_arc(float *position, float *target, float *offset, unsigned char axis_0, unsigned char axis_1,
   unsigned char axis_linear, float feed_rate, float radius, unsigned char isclockwise, uint8_t extruder);
+
+// Forget the arc in progress, the next mc_arc() call starts a new arc.
+void mc_arc_abort();
+
+// Queue a straight move from position to target through the segment coalescer. With SEGMENT_COALESCING
+// the move may be held back to be merged with the next one. Returns false if the planner is full, in
+// which case nothing changed and the call has to be repeated.
+bool mc_line(float *position, float *target, float feed_rate, uint8_t extruder);
+
+// Hand a held back move to the planner. Must be called before anything that depends on all moves being
+// in the planner. Returns false if the planner is full.
+bool mc_line_flush();
+
+// Forget a held back move, for a quick stop that drops the moves in the planner as well.
+void mc_line_discard();
   
 #endif
@@ -57,6 +57,7 @@
 #include "temperature.h"
 #include "ultralcd.h"
 #include "language.h"
+#include "trapezoid.h"
 
 //===========================================================================
 //=============================public variables ============================
@@ -72,6 +73,7 @@ float retract_acceleration; //  mm/s^2   filament pull-pack and push-forward  wh
 float max_xy_jerk; //speed than can be stopped at once, if i understand correctly.
 float max_z_jerk;
 float max_e_jerk;
+float junction_deviation;
 float mintravelfeedrate;
 unsigned long axis_steps_per_sqr_second[NUM_AXIS];
 
@@ -79,6 +81,8 @@ unsigned long axis_steps_per_sqr_second[NUM_AXIS];
 long position[4];   //rescaled from extern when axis_steps_per_unit are changed by gcode
 static float previous_speed[4]; // Speed of previous path line segment
 static float previous_nominal_speed; // Nominal speed of previous path line segment
+static float previous_unit_vec[3]; // Unit vector of previous path line segment, zero for extruder only moves
+static int planned_extrudemultiply = 100; // The extrudemultiply the steps_e of the buffered blocks are scaled with
 
 #ifdef AUTOTEMP
 float autotemp_max=250;
@@ -93,6 +97,12 @@ bool autotemp_enabled=false;
 block_t block_buffer[BLOCK_BUFFER_SIZE];            // A ring buffer for motion instfructions
 volatile unsigned char block_buffer_head;           // Index of the next block to be pushed
 volatile unsigned char block_buffer_tail;           // Index of the block to process now
+volatile unsigned char block_buffer_planned;        // Index of the last optimally planned block
+volatile unsigned long block_buffer_time;           // Sum of the segment_time of all blocks in the buffer, in us
+
+// Build time checks of the block buffer. A failing check shows up as a negative array size error.
+typedef char BLOCK_BUFFER_SIZE_must_be_a_power_of_2[(BLOCK_BUFFER_SIZE & (BLOCK_BUFFER_SIZE - 1)) == 0 ? 1 : -1];
+// The SRAM budget of the block buffer is checked in stepper.cpp, together with the segment buffer.
 
 //===========================================================================
 //=============================private variables ============================
@@ -128,39 +138,12 @@ static int8_t prev_block_index(int8_t block_index) {
   return(block_index);
 }
 
+static bool plan_queue_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder);
+
 //===========================================================================
 //=============================functions         ============================
 //===========================================================================
 
-// Calculates the distance (not time) it takes to accelerate from initial_rate to target_rate using the 
-// given acceleration:
-FORCE_INLINE float estimate_acceleration_distance(float initial_rate, float target_rate, float acceleration)
-{
-  if (acceleration!=0) {
-    return((target_rate*target_rate-initial_rate*initial_rate)/
-      (2.0*acceleration));
-  }
-  else {
-    return 0.0;  // acceleration was 0, set acceleration distance to 0
-  }
-}
-
-// This function gives you the point at which you must start braking (at the rate of -acceleration) if 
-// you started at speed initial_rate and accelerated until this point and want to end at the final_rate after
-// a total travel of distance. This can be used to compute the intersection point between acceleration and
-// deceleration in the cases where the trapezoid has no plateau (i.e. never reaches maximum speed)
-
-FORCE_INLINE float intersection_distance(float initial_rate, float final_rate, float acceleration, float distance) 
-{
-  if (acceleration!=0) {
-    return((2.0*acceleration*distance-initial_rate*initial_rate+final_rate*final_rate)/
-      (4.0*acceleration) );
-  }
-  else {
-    return 0.0;  // acceleration was 0, set intersection distance to 0
-  }
-}
-
 // Calculates trapezoid parameters so that the entry- and exit-speed is compensated by the provided factors.
 
 void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exit_factor) {
@@ -175,24 +158,15 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
     final_rate=120;  
   }
 
-  long acceleration = block->acceleration_st;
-  int32_t accelerate_steps =
-    ceil(estimate_acceleration_distance(initial_rate, block->nominal_rate, acceleration));
-  int32_t decelerate_steps =
-    floor(estimate_acceleration_distance(block->nominal_rate, final_rate, -acceleration));
-
-  // Calculate the size of Plateau of Nominal Rate.
-  int32_t plateau_steps = block->step_event_count-accelerate_steps-decelerate_steps;
+  int32_t accelerate_steps, plateau_steps;
+#ifdef FIXED_POINT_TRAPEZOID
+  trapezoid_steps_fixed(initial_rate, final_rate, block->nominal_rate, block->acceleration_st, block->step_event_count,
+    accelerate_steps, plateau_steps);
+#else
+  trapezoid_steps_float(initial_rate, final_rate, block->nominal_rate, block->acceleration_st, block->step_event_count,
+    accelerate_steps, plateau_steps);
+#endif
 
-  // Is the Plateau of Nominal Rate smaller than nothing? That means no cruising, and we will
-  // have to use intersection_distance() to calculate when to abort acceleration and start braking
-  // in order to reach the final_rate exactly at the end of this block.
-  if (plateau_steps < 0) {
-    accelerate_steps = ceil(intersection_distance(initial_rate, final_rate, acceleration, block->step_event_count));
-    accelerate_steps = max(accelerate_steps,0); // Check limits due to numerical round-off
-    accelerate_steps = min((uint32_t)accelerate_steps,block->step_event_count);//(We can cast here to unsigned, because the above line ensures that we are above zero)
-    plateau_steps = 0;
-  }
   // block->accelerate_until = accelerate_steps;
   // block->decelerate_after = accelerate_steps+plateau_steps;
   CRITICAL_SECTION_START;  // Fill variables used by the stepper in a critical section
@@ -206,9 +180,9 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
 }                    
 
 // Calculates the maximum allowable speed at this point when you must be able to reach target_velocity using the 
-// acceleration within the allotted distance.
-FORCE_INLINE float max_allowable_speed(float acceleration, float target_velocity, float distance) {
-  return  sqrt(target_velocity*target_velocity-2*acceleration*distance);
+// acceleration within the allotted distance. delta_speed_sqr is 2*acceleration*distance, see block_t.
+FORCE_INLINE float max_allowable_speed(float target_velocity, float delta_speed_sqr) {
+  return  sqrt(target_velocity*target_velocity+delta_speed_sqr);
 }
 
 // "Junction jerk" in this context is the immediate change in speed at the junction of two blocks.
@@ -236,7 +210,7 @@ void planner_reverse_pass_kernel(block_t *previous, block_t *current, block_t *n
       // for max allowable speed if block is decelerating and nominal length is false.
       if ((!current->nominal_length_flag) && (current->max_entry_speed > next->entry_speed)) {
         current->entry_speed = min( current->max_entry_speed,
-        max_allowable_speed(-current->acceleration,next->entry_speed,current->millimeters));
+        max_allowable_speed(next->entry_speed,current->delta_speed_sqr));
       } 
       else {
         current->entry_speed = current->max_entry_speed;
@@ -248,26 +222,26 @@ void planner_reverse_pass_kernel(block_t *previous, block_t *current, block_t *n
 }
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
-// implements the reverse pass.
+// implements the reverse pass. Only the blocks after block_buffer_planned are visited, everything up to
+// the watermark is already optimally planned and can not be improved by adding more blocks.
 void planner_reverse_pass() {
-  uint8_t block_index = block_buffer_head;
-  
-  //Make a local copy of block_buffer_tail, because the interrupt can alter it
+  //Make a local copy of block_buffer_planned, because the interrupt can push it forward
   CRITICAL_SECTION_START;
-  unsigned char tail = block_buffer_tail;
+  unsigned char planned = block_buffer_planned;
   CRITICAL_SECTION_END
   
-  if(((block_buffer_head-tail + BLOCK_BUFFER_SIZE) & (BLOCK_BUFFER_SIZE - 1)) > 3) {
-    block_index = (block_buffer_head - 3) & (BLOCK_BUFFER_SIZE - 1);
-    block_t *block[3] = { 
-      NULL, NULL, NULL         };
-    while(block_index != tail) { 
-      block_index = prev_block_index(block_index); 
-      block[2]= block[1];
-      block[1]= block[0];
-      block[0] = &block_buffer[block_index];
-      planner_reverse_pass_kernel(block[0], block[1], block[2]);
-    }
+  if(planned == block_buffer_head) {
+    return;
+  }
+  uint8_t block_index = block_buffer_head;
+  block_t *block[3] = { 
+    NULL, NULL, NULL         };
+  while(block_index != planned) { 
+    block_index = prev_block_index(block_index); 
+    block[2]= block[1];
+    block[1]= block[0];
+    block[0] = &block_buffer[block_index];
+    planner_reverse_pass_kernel(block[0], block[1], block[2]);
   }
 }
 
@@ -284,7 +258,7 @@ void planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *n
   if (!previous->nominal_length_flag) {
     if (previous->entry_speed < current->entry_speed) {
       double entry_speed = min( current->entry_speed,
-      max_allowable_speed(-previous->acceleration,previous->entry_speed,previous->millimeters) );
+      max_allowable_speed(previous->entry_speed,previous->delta_speed_sqr) );
 
       // Check for junction speed change
       if (current->entry_speed != entry_speed) {
@@ -296,27 +270,38 @@ void planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *n
 }
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
-// implements the forward pass.
+// implements the forward pass. It starts at block_buffer_planned and moves the watermark up to the last
+// block whose entry speed is final: either it sits at its maximum junction speed, or it is limited by
+// the acceleration out of the previous (already final) block.
 void planner_forward_pass() {
-  uint8_t block_index = block_buffer_tail;
-  block_t *block[3] = { 
-    NULL, NULL, NULL   };
+  uint8_t block_index = block_buffer_planned;
+  block_t *previous = NULL;
+  block_t *current;
 
   while(block_index != block_buffer_head) {
-    block[0] = block[1];
-    block[1] = block[2];
-    block[2] = &block_buffer[block_index];
-    planner_forward_pass_kernel(block[0],block[1],block[2]);
+    current = &block_buffer[block_index];
+    // A busy previous block is already being traced with its current exit speed, so the entry
+    // speed of this block must be left alone.
+    if (previous && !previous->busy) {
+      float entry_speed = current->entry_speed;
+      planner_forward_pass_kernel(previous, current, NULL);
+      if (current->entry_speed != entry_speed || current->entry_speed == current->max_entry_speed) {
+        CRITICAL_SECTION_START;
+        if (!current->busy) block_buffer_planned = block_index;
+        CRITICAL_SECTION_END;
+      }
+    }
+    previous = current;
     block_index = next_block_index(block_index);
   }
-  planner_forward_pass_kernel(block[1], block[2], NULL);
 }
 
-// Recalculates the trapezoid speed profiles for all blocks in the plan according to the 
+// Recalculates the trapezoid speed profiles for the blocks in the plan according to the 
 // entry_factor for each junction. Must be called by planner_recalculate() after 
 // updating the blocks.
-void planner_recalculate_trapezoids() {
-  int8_t block_index = block_buffer_tail;
+// Only the blocks from block_index onwards can have a changed entry or exit speed, so the scan
+// starts there instead of at the tail.
+void planner_recalculate_trapezoids(int8_t block_index) {
   block_t *current;
   block_t *next = NULL;
 
@@ -358,22 +343,34 @@ void planner_recalculate_trapezoids() {
 // the set limit. Finally it will:
 //
 //   3. Recalculate trapezoids for all blocks.
+//
+// All three steps start at block_buffer_planned. Blocks before it are bracketed by junctions that are
+// already at their final speed, so they are never visited again. This keeps the cost of adding a
+// block independent of BLOCK_BUFFER_SIZE in the common case.
 
 void planner_recalculate() {   
+  CRITICAL_SECTION_START;
+  unsigned char planned = block_buffer_planned;
+  CRITICAL_SECTION_END
   planner_reverse_pass();
   planner_forward_pass();
-  planner_recalculate_trapezoids();
+  planner_recalculate_trapezoids(planned);
 }
 
 void plan_init() {
   block_buffer_head = 0;
   block_buffer_tail = 0;
+  block_buffer_planned = 0;
+  block_buffer_time = 0;
   memset(position, 0, sizeof(position)); // clear position
   previous_speed[0] = 0.0;
   previous_speed[1] = 0.0;
   previous_speed[2] = 0.0;
   previous_speed[3] = 0.0;
   previous_nominal_speed = 0.0;
+  previous_unit_vec[0] = 0.0;
+  previous_unit_vec[1] = 0.0;
+  previous_unit_vec[2] = 0.0;
 }
 
 
@@ -476,30 +473,70 @@ void check_axes_activity()
 #endif
 }
 
-
-float junction_deviation = 0.1;
 // Add a new linear movement to the buffer. steps_x, _y and _z is the absolute position in 
 // mm. Microseconds specify how many microseconds the move should take to perform. To aid acceleration
 // calculation the caller must also provide the physical length of the line in millimeters.
-
+// Blocks until there is room in the buffer. Only for moves that have to be queued right away,
+// the main command stream goes through plan_try_buffer_line() and lets loop() retry.
 void plan_buffer_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder)
-
 {
-  // Calculate the buffer head after we push this byte
-  int next_buffer_head = next_block_index(block_buffer_head);
-
   // If the buffer is full: good! That means we are well ahead of the robot. 
   // Rest here until there is room in the buffer.
-  while(block_buffer_tail == next_buffer_head)
+  while(!plan_try_buffer_line(x, y, z, e, feed_rate, extruder))
   {
     manage_heater(); 
     manage_inactivity(); 
     lcd_update();
   }
+}
+
+// Same as plan_buffer_line(), but returns false without touching the planner if the buffer is full.
+// Moves that are too short to be executed are dropped and still count as buffered.
+bool plan_try_buffer_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder)
+{
+  if(!plan_queue_line(x, y, z, e, feed_rate, extruder))
+  {
+    return false;
+  }
+  planner_recalculate();
+  st_wake_up();
+  return true;
+}
+
+// Add a polyline through count absolute XYZE points, all with the same feed rate. Queues as many
+// points as there is room for and runs the look-ahead once for the whole batch instead of once per
+// segment. Returns the number of points taken, the caller passes the remaining ones again later.
+uint8_t plan_try_buffer_polyline(const float (*points)[NUM_AXIS], uint8_t count, float feed_rate, const uint8_t &extruder)
+{
+  uint8_t queued = 0;
+  while(queued < count &&
+    plan_queue_line(points[queued][X_AXIS], points[queued][Y_AXIS], points[queued][Z_AXIS], points[queued][E_AXIS], feed_rate, extruder))
+  {
+    queued++;
+  }
+  if(queued)
+  {
+    planner_recalculate();
+    st_wake_up();
+  }
+  return queued;
+}
+
+// Converts the move to steps and appends its block to the buffer, but leaves the look-ahead
+// recalculation and waking up the stepper to the caller.
+static bool plan_queue_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder)
+{
+  // Calculate the buffer head after we push this byte
+  int next_buffer_head = next_block_index(block_buffer_head);
+
+  if(block_buffer_tail == next_buffer_head)
+  {
+    return false;
+  }
 
   // The target position of the tool in absolute steps
   // Calculate target position in absolute steps
-  //this should be done after the wait, because otherwise a M92 code within the gcode disrupts this calculation somehow
+  //this should be done after the check for room, because otherwise a M92 code within the gcode disrupts this calculation somehow
   long target[4];
   target[X_AXIS] = lround(x*axis_steps_per_unit[X_AXIS]);
   target[Y_AXIS] = lround(y*axis_steps_per_unit[Y_AXIS]);
@@ -542,12 +579,13 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   block->steps_e *= volumetric_multiplier[active_extruder];
   block->steps_e *= extrudemultiply;
   block->steps_e /= 100;
+  planned_extrudemultiply = extrudemultiply;
   block->step_event_count = max(block->steps_x, max(block->steps_y, max(block->steps_z, block->steps_e)));
 
   // Bail if this is a zero-length block
   if (block->step_event_count <= dropsegments)
   { 
-    return; 
+    return true; 
   }
 
   block->fan_speed = fanSpeed;
@@ -601,6 +639,14 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
     }
   }
 
+  // The feed override applies to moves in the XY plane only. It is taken out again for programmed_rate,
+  // so the block can follow later changes of the override while it is buffered.
+  bool feed_override = (block->steps_x != 0 || block->steps_y != 0) && feedmultiply > 0;
+  if (feed_override)
+  {
+    feed_rate = feed_rate*feedmultiply/100.0;
+  }
+
   if (block->steps_e == 0)
   {
     if(feed_rate<mintravelfeedrate) feed_rate=mintravelfeedrate;
@@ -615,15 +661,16 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   delta_mm[Y_AXIS] = (target[Y_AXIS]-position[Y_AXIS])/axis_steps_per_unit[Y_AXIS];
   delta_mm[Z_AXIS] = (target[Z_AXIS]-position[Z_AXIS])/axis_steps_per_unit[Z_AXIS];
   delta_mm[E_AXIS] = ((target[E_AXIS]-position[E_AXIS])/axis_steps_per_unit[E_AXIS])*volumetric_multiplier[active_extruder]*extrudemultiply/100.0;
+  float millimeters;
   if ( block->steps_x <=dropsegments && block->steps_y <=dropsegments && block->steps_z <=dropsegments )
   {
-    block->millimeters = fabs(delta_mm[E_AXIS]);
+    millimeters = fabs(delta_mm[E_AXIS]);
   } 
   else
   {
-    block->millimeters = sqrt(square(delta_mm[X_AXIS]) + square(delta_mm[Y_AXIS]) + square(delta_mm[Z_AXIS]));
+    millimeters = sqrt(square(delta_mm[X_AXIS]) + square(delta_mm[Y_AXIS]) + square(delta_mm[Z_AXIS]));
   }
-  float inverse_millimeters = 1.0/block->millimeters;  // Inverse millimeters to remove multiple divides 
+  float inverse_millimeters = 1.0/millimeters;  // Inverse millimeters to remove multiple divides 
 
     // Calculate speed in mm/second for each axis. No divide by zero due to previous checks.
   float inverse_second = feed_rate * inverse_millimeters;
@@ -639,11 +686,12 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
 #ifdef SLOWDOWN
   //  segment time im micro seconds
   unsigned long segment_time = lround(1000000.0/inverse_second);
-  if ((moves_queued > 1) && (moves_queued < (BLOCK_BUFFER_SIZE * 0.5)))
+  if (moves_queued > 1)
   {
-    if (segment_time < minsegmenttime)
+    unsigned long buffered_time = plan_buffered_time();
+    if ((buffered_time < SLOWDOWN_BUFFER_TIME) && (segment_time < minsegmenttime))
     { // buffer is draining, add extra time.  The amount of time added increases if the buffer is still emptied more.
-      inverse_second=1000000.0/(segment_time+lround(2*(minsegmenttime-segment_time)/moves_queued));
+      inverse_second=1000000.0/(segment_time+lround((float)(minsegmenttime-segment_time)*(SLOWDOWN_BUFFER_TIME-buffered_time)/SLOWDOWN_BUFFER_TIME));
       #ifdef XY_FREQUENCY_LIMIT
          segment_time = lround(1000000.0/inverse_second);
       #endif
@@ -653,8 +701,9 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   //  END OF SLOW DOWN SECTION    
 
 
-  block->nominal_speed = block->millimeters * inverse_second; // (mm/sec) Always > 0
-  block->nominal_rate = ceil(block->step_event_count * inverse_second); // (step/sec) Always > 0
+  block->nominal_speed = millimeters * inverse_second; // (mm/sec) Always > 0
+  float nominal_rate = ceil(block->step_event_count * inverse_second); // (step/sec) Always > 0
+  block->programmed_rate = feed_override ? min(nominal_rate*100.0/feedmultiply, 65535.0) : 0;
 
   // Calculate and limit speed in mm/sec for each axis
   float current_speed[4];
@@ -709,11 +758,14 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
       current_speed[i] *= speed_factor;
     }
     block->nominal_speed *= speed_factor;
-    block->nominal_rate *= speed_factor;
+    nominal_rate *= speed_factor;
   }
+  // The stepper interrupt works with 16 bit step rates and is limited to MAX_STEP_FREQUENCY anyway
+  block->nominal_rate = min(nominal_rate, 65535.0);
+  block->segment_time = lround(1000000.0/(inverse_second*speed_factor));
 
   // Compute and limit the acceleration rate for the trapezoid generator.  
-  float steps_per_mm = block->step_event_count/block->millimeters;
+  float steps_per_mm = block->step_event_count/millimeters;
   if(block->steps_x == 0 && block->steps_y == 0 && block->steps_z == 0)
   {
     block->acceleration_st = ceil(retract_acceleration * steps_per_mm); // convert to: acceleration steps/sec^2
@@ -731,49 +783,19 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
     if(((float)block->acceleration_st * (float)block->steps_z / (float)block->step_event_count ) > axis_steps_per_sqr_second[Z_AXIS])
       block->acceleration_st = axis_steps_per_sqr_second[Z_AXIS];
   }
-  block->acceleration = block->acceleration_st / steps_per_mm;
-  block->acceleration_rate = (long)((float)block->acceleration_st * (16777216.0 / (F_CPU / 8.0)));
-
-#if 0  // Use old jerk for now
-  // Compute path unit vector
-  double unit_vec[3];
-
-  unit_vec[X_AXIS] = delta_mm[X_AXIS]*inverse_millimeters;
-  unit_vec[Y_AXIS] = delta_mm[Y_AXIS]*inverse_millimeters;
-  unit_vec[Z_AXIS] = delta_mm[Z_AXIS]*inverse_millimeters;
-
-  // Compute maximum allowable entry speed at junction by centripetal acceleration approximation.
-  // Let a circle be tangent to both previous and current path line segments, where the junction
-  // deviation is defined as the distance from the junction to the closest edge of the circle,
-  // colinear with the circle center. The circular segment joining the two paths represents the
-  // path of centripetal acceleration. Solve for max velocity based on max acceleration about the
-  // radius of the circle, defined indirectly by junction deviation. This may be also viewed as
-  // path width or max_jerk in the previous grbl version. This approach does not actually deviate
-  // from path, but used as a robust way to compute cornering speeds, as it takes into account the
-  // nonlinearities of both the junction angle and junction velocity.
-  double vmax_junction = MINIMUM_PLANNER_SPEED; // Set default max junction speed
-
-  // Skip first block or when previous_nominal_speed is used as a flag for homing and offset cycles.
-  if ((block_buffer_head != block_buffer_tail) && (previous_nominal_speed > 0.0)) {
-    // Compute cosine of angle between previous and current path. (prev_unit_vec is negative)
-    // NOTE: Max junction velocity is computed without sin() or acos() by trig half angle identity.
-    double cos_theta = - previous_unit_vec[X_AXIS] * unit_vec[X_AXIS]
-      - previous_unit_vec[Y_AXIS] * unit_vec[Y_AXIS]
-      - previous_unit_vec[Z_AXIS] * unit_vec[Z_AXIS] ;
-
-    // Skip and use default max junction speed for 0 degree acute junction.
-    if (cos_theta < 0.95) {
-      vmax_junction = min(previous_nominal_speed,block->nominal_speed);
-      // Skip and avoid divide by zero for straight junctions at 180 degrees. Limit to min() of nominal speeds.
-      if (cos_theta > -0.95) {
-        // Compute maximum junction velocity based on maximum acceleration and junction deviation
-        double sin_theta_d2 = sqrt(0.5*(1.0-cos_theta)); // Trig half angle identity. Always positive.
-        vmax_junction = min(vmax_junction,
-        sqrt(block->acceleration * junction_deviation * sin_theta_d2/(1.0-sin_theta_d2)) );
-      }
-    }
+  if(block->acceleration_st > MAX_ACCELERATION_ST)
+    block->acceleration_st = MAX_ACCELERATION_ST;
+  float block_acceleration = block->acceleration_st / steps_per_mm;
+
+  // Compute path unit vector. Extruder only moves have no XYZ direction and keep the zero vector.
+  float unit_vec[3] = { 0.0, 0.0, 0.0 };
+  if ( block->steps_x > dropsegments || block->steps_y > dropsegments || block->steps_z > dropsegments )
+  {
+    unit_vec[X_AXIS] = delta_mm[X_AXIS]*inverse_millimeters;
+    unit_vec[Y_AXIS] = delta_mm[Y_AXIS]*inverse_millimeters;
+    unit_vec[Z_AXIS] = delta_mm[Z_AXIS]*inverse_millimeters;
   }
-#endif
+
   // Start with a safe speed
   float vmax_junction = max_xy_jerk/2; 
   float vmax_junction_factor = 1.0; 
@@ -785,25 +807,63 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   float safe_speed = vmax_junction;
 
   if ((moves_queued > 1) && (previous_nominal_speed > 0.0001)) {
-    float jerk = sqrt(pow((current_speed[X_AXIS]-previous_speed[X_AXIS]), 2)+pow((current_speed[Y_AXIS]-previous_speed[Y_AXIS]), 2));
-    //    if((fabs(previous_speed[X_AXIS]) > 0.0001) || (fabs(previous_speed[Y_AXIS]) > 0.0001)) {
-    vmax_junction = block->nominal_speed;
-    //    }
-    if (jerk > max_xy_jerk) {
-      vmax_junction_factor = (max_xy_jerk/jerk);
-    } 
-    if(fabs(current_speed[Z_AXIS] - previous_speed[Z_AXIS]) > max_z_jerk) {
-      vmax_junction_factor= min(vmax_junction_factor, (max_z_jerk/fabs(current_speed[Z_AXIS] - previous_speed[Z_AXIS])));
-    } 
-    if(fabs(current_speed[E_AXIS] - previous_speed[E_AXIS]) > max_e_jerk) {
-      vmax_junction_factor = min(vmax_junction_factor, (max_e_jerk/fabs(current_speed[E_AXIS] - previous_speed[E_AXIS])));
-    } 
-    vmax_junction = min(previous_nominal_speed, vmax_junction * vmax_junction_factor); // Limit speed to max previous speed
+    bool xyz_junction = (unit_vec[X_AXIS] != 0.0 || unit_vec[Y_AXIS] != 0.0 || unit_vec[Z_AXIS] != 0.0) &&
+      (previous_unit_vec[X_AXIS] != 0.0 || previous_unit_vec[Y_AXIS] != 0.0 || previous_unit_vec[Z_AXIS] != 0.0);
+    if (junction_deviation > 0.0 && xyz_junction) {
+      // Compute maximum allowable entry speed at junction by centripetal acceleration approximation.
+      // Let a circle be tangent to both previous and current path line segments, where the junction
+      // deviation is defined as the distance from the junction to the closest edge of the circle,
+      // colinear with the circle center. The circular segment joining the two paths represents the
+      // path of centripetal acceleration. Solve for max velocity based on max acceleration about the
+      // radius of the circle, defined indirectly by junction deviation. This approach does not actually
+      // deviate from path, but used as a robust way to compute cornering speeds, as it takes into account
+      // the nonlinearities of both the junction angle and junction velocity.
+      vmax_junction = MINIMUM_PLANNER_SPEED; // Set default max junction speed
+
+      // Compute cosine of angle between previous and current path. (prev_unit_vec is negative)
+      // NOTE: Max junction velocity is computed without sin() or acos() by trig half angle identity.
+      float cos_theta = - previous_unit_vec[X_AXIS] * unit_vec[X_AXIS]
+        - previous_unit_vec[Y_AXIS] * unit_vec[Y_AXIS]
+        - previous_unit_vec[Z_AXIS] * unit_vec[Z_AXIS] ;
+
+      // Skip and use default max junction speed for 0 degree acute junction.
+      if (cos_theta < 0.95) {
+        vmax_junction = min(previous_nominal_speed,block->nominal_speed);
+        // Skip and avoid divide by zero for straight junctions at 180 degrees. Limit to min() of nominal speeds.
+        if (cos_theta > -0.95) {
+          // Compute maximum junction velocity based on maximum acceleration and junction deviation
+          float sin_theta_d2 = sqrt(0.5*(1.0-cos_theta)); // Trig half angle identity. Always positive.
+          vmax_junction = min(vmax_junction,
+          sqrt(block_acceleration * junction_deviation * sin_theta_d2/(1.0-sin_theta_d2)) );
+        }
+      }
+      // The extruder is not part of the path geometry, keep its jerk limit.
+      if(fabs(current_speed[E_AXIS] - previous_speed[E_AXIS]) > max_e_jerk) {
+        vmax_junction = min(vmax_junction, block->nominal_speed * (max_e_jerk/fabs(current_speed[E_AXIS] - previous_speed[E_AXIS])));
+      }
+    }
+    else {
+      float jerk = sqrt(pow((current_speed[X_AXIS]-previous_speed[X_AXIS]), 2)+pow((current_speed[Y_AXIS]-previous_speed[Y_AXIS]), 2));
+      //    if((fabs(previous_speed[X_AXIS]) > 0.0001) || (fabs(previous_speed[Y_AXIS]) > 0.0001)) {
+      vmax_junction = block->nominal_speed;
+      //    }
+      if (jerk > max_xy_jerk) {
+        vmax_junction_factor = (max_xy_jerk/jerk);
+      } 
+      if(fabs(current_speed[Z_AXIS] - previous_speed[Z_AXIS]) > max_z_jerk) {
+        vmax_junction_factor= min(vmax_junction_factor, (max_z_jerk/fabs(current_speed[Z_AXIS] - previous_speed[Z_AXIS])));
+      } 
+      if(fabs(current_speed[E_AXIS] - previous_speed[E_AXIS]) > max_e_jerk) {
+        vmax_junction_factor = min(vmax_junction_factor, (max_e_jerk/fabs(current_speed[E_AXIS] - previous_speed[E_AXIS])));
+      } 
+      vmax_junction = min(previous_nominal_speed, vmax_junction * vmax_junction_factor); // Limit speed to max previous speed
+    }
   }
   block->max_entry_speed = vmax_junction;
 
   // Initialize block entry speed. Compute based on deceleration to user-defined MINIMUM_PLANNER_SPEED.
-  double v_allowable = max_allowable_speed(-block->acceleration,MINIMUM_PLANNER_SPEED,block->millimeters);
+  block->delta_speed_sqr = 2.0*block_acceleration*millimeters;
+  double v_allowable = max_allowable_speed(MINIMUM_PLANNER_SPEED,block->delta_speed_sqr);
   block->entry_speed = min(vmax_junction, v_allowable);
 
   // Initialize planner efficiency flags
@@ -824,19 +884,20 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
 
   // Update previous path unit_vector and nominal speed
   memcpy(previous_speed, current_speed, sizeof(previous_speed)); // previous_speed[] = current_speed[]
+  memcpy(previous_unit_vec, unit_vec, sizeof(previous_unit_vec)); // previous_unit_vec[] = unit_vec[]
   previous_nominal_speed = block->nominal_speed;
   calculate_trapezoid_for_block(block, block->entry_speed/block->nominal_speed,
   safe_speed/block->nominal_speed);
 
-  // Move buffer head
+  // Move buffer head, the stepper interrupt takes the time off again when it discards the block
+  CRITICAL_SECTION_START;
+  block_buffer_time += block->segment_time;
   block_buffer_head = next_buffer_head;
+  CRITICAL_SECTION_END;
 
   // Update position
   memcpy(position, target, sizeof(target)); // position[] = target[]
-
-  planner_recalculate();
-
-  st_wake_up();
+  return true;
 }
 
 void plan_set_position(const float &x, const float &y, const float &z, const float &e)
@@ -851,6 +912,9 @@ void plan_set_position(const float &x, const float &y, const float &z, const flo
   previous_speed[1] = 0.0;
   previous_speed[2] = 0.0;
   previous_speed[3] = 0.0;
+  previous_unit_vec[0] = 0.0;
+  previous_unit_vec[1] = 0.0;
+  previous_unit_vec[2] = 0.0;
 }
 
 void plan_set_e_position(const float &e)
@@ -859,6 +923,89 @@ void plan_set_e_position(const float &e)
   st_set_e_position(position[E_AXIS]);
 }
 
+unsigned long plan_buffered_time()
+{
+  CRITICAL_SECTION_START;
+  unsigned long buffered_time = block_buffer_time;
+  CRITICAL_SECTION_END;
+  return buffered_time;
+}
+
+// The highest step rate of the block the max_feedrate of its axes allow
+static float max_block_rate(block_t *block)
+{
+  long steps[4] = { block->steps_x, block->steps_y, block->steps_z, block->steps_e };
+  float rate = 65535.0;
+  for(int8_t i=0; i < NUM_AXIS; i++)
+  {
+    if(steps[i] != 0)
+      rate = min(rate, max_feedrate[i]*axis_steps_per_unit[i]*block->step_event_count/steps[i]);
+  }
+  return rate;
+}
+
+void plan_update_overrides()
+{
+  float e_factor = (float)extrudemultiply/planned_extrudemultiply;
+  planned_extrudemultiply = extrudemultiply;
+  unsigned char first_free = block_buffer_head; // The first block the stepper has not started on
+  block_t *previous = NULL;
+
+  for(unsigned char block_index = block_buffer_tail; block_index != block_buffer_head; block_index = next_block_index(block_index))
+  {
+    block_t *block = &block_buffer[block_index];
+    bool busy = block->busy;
+    if(!busy && first_free == block_buffer_head) first_free = block_index;
+
+    // The flow override changes the extrusion of blocks that are not driven by the extruder. The
+    // E steps of a busy block are being traced already, they stay as they are.
+    if(!busy && e_factor != 1.0 && block->steps_e != 0 && block->steps_e < (long)block->step_event_count)
+    {
+      block->steps_e = min(lround(block->steps_e*e_factor), (long)block->step_event_count);
+    }
+
+    if(block->programmed_rate != 0)
+    {
+      float rate = min((float)block->programmed_rate*feedmultiply/100.0, max_block_rate(block));
+      if(rate < 1.0) rate = 1.0;
+      if((unsigned short)rate != block->nominal_rate)
+      {
+        float factor = rate/block->nominal_rate;
+        block->nominal_speed *= factor;
+        block->nominal_rate = rate;
+        unsigned long segment_time = block->segment_time/factor;
+        CRITICAL_SECTION_START;
+        block_buffer_time += segment_time - block->segment_time;
+        block->segment_time = segment_time;
+        CRITICAL_SECTION_END;
+        if(block_index == prev_block_index(block_buffer_head))
+        {
+          // The next move is planned against this one
+          previous_nominal_speed = block->nominal_speed;
+          for(int8_t i=0; i < NUM_AXIS; i++) previous_speed[i] *= factor;
+        }
+      }
+    }
+
+    if(!busy)
+    {
+      // A faster block keeps its old junction speeds, a slower one has to be entered slower too
+      block->max_entry_speed = min(block->max_entry_speed, block->nominal_speed);
+      if(previous != NULL) block->max_entry_speed = min(block->max_entry_speed, previous->nominal_speed);
+      block->entry_speed = min(block->entry_speed, block->max_entry_speed);
+      block->nominal_length_flag = (block->nominal_speed <= max_allowable_speed(MINIMUM_PLANNER_SPEED, block->delta_speed_sqr));
+      block->recalculate_flag = true;
+    }
+    previous = block;
+  }
+
+  // Everything the stepper has not started on has to be planned again
+  CRITICAL_SECTION_START;
+  block_buffer_planned = first_free;
+  CRITICAL_SECTION_END;
+  planner_recalculate();
+}
+
 uint8_t movesplanned()
 {
   return (block_buffer_head-block_buffer_tail + BLOCK_BUFFER_SIZE) & (BLOCK_BUFFER_SIZE - 1);
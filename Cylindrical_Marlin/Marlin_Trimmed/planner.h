@@ -28,33 +28,36 @@
 
 // This struct is used when buffering the setup for each linear movement "nominal" values are as specified in 
 // the source g-code and may never actually be reached if acceleration management is active.
+// Keep it compact, every byte here is taken BLOCK_BUFFER_SIZE times. Step rates are 16 bit like the
+// stepper interrupt's own rate arithmetic, and the flags are packed into a single byte. What
+// st_prep_buffer() can work out once per block, like the ramp constants, is not stored here.
 typedef struct {
   // Fields used by the bresenham algorithm for tracing the line
   long steps_x, steps_y, steps_z, steps_e;  // Step count along each axis
   unsigned long step_event_count;           // The number of step events required to complete this block
   long accelerate_until;                    // The index of the step event on which to stop acceleration
   long decelerate_after;                    // The index of the step event on which to start decelerating
-  long acceleration_rate;                   // The acceleration rate used for acceleration calculation
   unsigned char direction_bits;             // The direction bit set for this block (refers to *_DIRECTION_BIT in config.h)
-  unsigned char active_extruder;            // Selects the active extruder
+  unsigned char active_extruder : 2;        // Selects the active extruder
 
   // Fields used by the motion planner to manage acceleration
+  unsigned char recalculate_flag : 1;                // Planner flag to recalculate trapezoids on entry junction
+  unsigned char nominal_length_flag : 1;             // Planner flag for nominal speed always reached
 //  float speed_x, speed_y, speed_z, speed_e;        // Nominal mm/sec for each axis
   float nominal_speed;                               // The nominal speed for this block in mm/sec 
   float entry_speed;                                 // Entry speed at previous-current junction in mm/sec
   float max_entry_speed;                             // Maximum allowable junction entry speed in mm/sec
-  float millimeters;                                 // The total travel of this block in mm
-  float acceleration;                                // acceleration mm/sec^2
-  unsigned char recalculate_flag;                    // Planner flag to recalculate trapezoids on entry junction
-  unsigned char nominal_length_flag;                 // Planner flag for nominal speed always reached
+  float delta_speed_sqr;                             // 2*acceleration*millimeters, the largest change of speed^2 over this block
 
   // Settings for the trapezoid generator
-  unsigned long nominal_rate;                        // The nominal step rate for this block in step_events/sec 
-  unsigned long initial_rate;                        // The jerk-adjusted step rate at start of block  
-  unsigned long final_rate;                          // The minimal rate at exit
+  unsigned short nominal_rate;                       // The nominal step rate for this block in step_events/sec 
+  unsigned short initial_rate;                       // The jerk-adjusted step rate at start of block  
+  unsigned short final_rate;                         // The minimal rate at exit
+  unsigned short programmed_rate;                    // nominal_rate at 100% feed override, 0 if the override does not apply
   unsigned long acceleration_st;                     // acceleration steps/sec^2
-  unsigned long fan_speed;
-  volatile char busy;
+  unsigned long segment_time;                        // Execution time at nominal speed in microseconds
+  unsigned char fan_speed;
+  volatile char busy;                                // Written by the stepper interrupt, so not part of the packed flags
 } block_t;
 
 // Initialize the motion plan subsystem      
@@ -65,6 +68,14 @@ void plan_init();
 
 void plan_buffer_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder);
 
+// Non-blocking version of plan_buffer_line(). Returns false and leaves the plan untouched if the
+// buffer is full, the caller has to try again later.
+bool plan_try_buffer_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder);
+
+// Add a polyline of count absolute XYZE points in millimeters with one feed rate, replanning once for
+// the whole batch. Returns how many points were buffered, fewer than count if the buffer filled up.
+uint8_t plan_try_buffer_polyline(const float (*points)[NUM_AXIS], uint8_t count, float feed_rate, const uint8_t &extruder);
+
 // Set position. Used for G92 instructions.
 void plan_set_position(const float &x, const float &y, const float &z, const float &e);
 
@@ -72,6 +83,12 @@ void plan_set_e_position(const float &e);
 
 void check_axes_activity();
 uint8_t movesplanned(); //return the nr of buffered moves
+unsigned long plan_buffered_time(); //return the time in microseconds the buffered moves take at nominal speed
+
+// Applies changed feedmultiply and extrudemultiply values to the moves already in the buffer. The
+// blocks the stepper has not started on are replanned, the block being cut into segments picks up its
+// new nominal rate in st_prep_buffer().
+void plan_update_overrides();
 
 extern unsigned long minsegmenttime;
 extern float max_feedrate[4]; // set the max speeds
@@ -83,6 +100,7 @@ extern float retract_acceleration; //  mm/s^2   filament pull-pack and push-forw
 extern float max_xy_jerk; //speed than can be stopped at once, if i understand correctly.
 extern float max_z_jerk;
 extern float max_e_jerk;
+extern float junction_deviation; // mm, 0 selects the legacy max_xy_jerk/max_z_jerk junction speeds
 extern float mintravelfeedrate;
 extern unsigned long axis_steps_per_sqr_second[NUM_AXIS];
 
@@ -99,11 +117,14 @@ extern unsigned long axis_steps_per_sqr_second[NUM_AXIS];
 extern block_t block_buffer[BLOCK_BUFFER_SIZE];            // A ring buffer for motion instfructions
 extern volatile unsigned char block_buffer_head;           // Index of the next block to be pushed
 extern volatile unsigned char block_buffer_tail; 
+extern volatile unsigned char block_buffer_planned;        // Index of the last optimally planned block
+extern volatile unsigned long block_buffer_time;           // Sum of the segment_time of all blocks in the buffer, in us
 // Called when the current block is no longer needed. Discards the block and makes the memory
 // availible for new blocks.    
 FORCE_INLINE void plan_discard_current_block()  
 {
   if (block_buffer_head != block_buffer_tail) {
+    block_buffer_time -= block_buffer[block_buffer_tail].segment_time;
     block_buffer_tail = (block_buffer_tail + 1) & (BLOCK_BUFFER_SIZE - 1);  
   }
 }
@@ -116,6 +137,25 @@ FORCE_INLINE block_t *plan_get_current_block()
   }
   block_t *block = &block_buffer[block_buffer_tail];
   block->busy = true;
+  // The busy block can not be replanned anymore, so push the planned watermark past it
+  if (block_buffer_planned == block_buffer_tail) {
+    block_buffer_planned = (block_buffer_tail + 1) & (BLOCK_BUFFER_SIZE - 1);
+  }
+  return(block);
+}
+
+// Gets the block at block_index for the segment preparation of the stepper, NULL if block_index is the
+// head. Like the current block it is busy from here on, so the planner leaves it alone.
+FORCE_INLINE block_t *plan_get_block(unsigned char block_index)
+{
+  if (block_index == block_buffer_head) {
+    return(NULL);
+  }
+  block_t *block = &block_buffer[block_index];
+  block->busy = true;
+  if (block_buffer_planned == block_index) {
+    block_buffer_planned = (block_index + 1) & (BLOCK_BUFFER_SIZE - 1);
+  }
   return(block);
 }
 
@@ -48,12 +48,95 @@ static long counter_x,       // Counter variables for the bresenham line tracer
             counter_z,
             counter_e;
 volatile static unsigned long step_events_completed; // The number of step events executed in the current block
+static unsigned char step_loops;             // Step events per interrupt in the current segment
+static unsigned short segment_steps_left;    // Step events left in the current segment
+#ifdef ADAPTIVE_STEP_SMOOTHING
+  #define AMASS_FULL_STEP (1 << AMASS_MAX_LEVEL)  // Tracer events per step event at the finest level
+static unsigned char amass_level;            // The line is traced 1 << amass_level times per step event
+static unsigned char amass_phase;            // Progress towards the next step event in 1/AMASS_FULL_STEP
+static unsigned char amass_phase_step;       // AMASS_FULL_STEP >> amass_level
+static unsigned long amass_event_count;      // step_event_count << AMASS_MAX_LEVEL
+static long amass_steps_x,                   // steps_* per tracer event at the current level
+            amass_steps_y,
+            amass_steps_z,
+            amass_steps_e;
+#endif
+
+// A slice of a block at one constant step rate, cut by st_prep_buffer() ahead of time so the
+// interrupt does not have to do any acceleration math
+typedef struct {
+  unsigned short step_events;   // Step events in this segment
+  unsigned short timer;         // OCR1A for every interrupt of the segment
+  unsigned char step_loops;     // Step events per interrupt
+  #ifdef ADAPTIVE_STEP_SMOOTHING
+  unsigned char amass_level;    // Interrupts per step event are 1 << amass_level
+  #endif
+  unsigned char end_of_block;   // Set on the last segment of a block
+} segment_t;
+
+#define SEGMENT_TICKS ((unsigned long)SEGMENT_TIME * (STEPPER_TIMER_RATE/1000) / 1000) // SEGMENT_TIME in timer ticks
+#define MIN_TIMER_TICKS (STEPPER_TIMER_RATE/20000) // Shortest interval of the stepper interrupt, 50us
+
+#if STEPPER_TIMER_PRESCALER == 8
+  #define STEPPER_TIMER_CLOCK_SELECT 2
+#elif STEPPER_TIMER_PRESCALER == 64
+  #define STEPPER_TIMER_CLOCK_SELECT 3
+#else
+  #error STEPPER_TIMER_PRESCALER has to be 8 or 64
+#endif
+
+// The segment ring buffer wraps with a mask, a size that is not a power of 2 fails to compile here
+typedef char SEGMENT_BUFFER_SIZE_must_be_a_power_of_2[(SEGMENT_BUFFER_SIZE & (SEGMENT_BUFFER_SIZE - 1)) == 0 ? 1 : -1];
+
+static segment_t segment_buffer[SEGMENT_BUFFER_SIZE];  // A ring buffer of the segments to execute
+
+#ifdef __AVR__
+// The block, segment and serial transmit buffers together may take the 1232 bytes of the 16 blocks of
+// 77 bytes the planner had before block_t was packed. block_t is 64 bytes and a segment 7 at most, so
+// 16 blocks, 16 segments and a TX_BUFFER_SIZE of 32 take 1170. A feature that does not fit has to make
+// room in block_t or take smaller buffers, this budget stays.
+#define MOTION_BUFFERS_SRAM_BUDGET 1232
+typedef char motion_buffers_exceed_their_SRAM_budget[
+  sizeof(block_t) * BLOCK_BUFFER_SIZE + sizeof(segment_buffer) + TX_BUFFER_SIZE <= MOTION_BUFFERS_SRAM_BUDGET ? 1 : -1];
+#endif
+static volatile unsigned char segment_buffer_head;     // Index of the next segment to be prepared
+static volatile unsigned char segment_buffer_tail;     // Index of the segment being executed
+static volatile unsigned char segment_buffer_flushes;  // Counts the times the interrupt dropped all segments
+static segment_t *current_segment;                     // The segment being executed, NULL between segments
+
+// Variables used by the segment preparation, st_prep_buffer() runs from loop()
+static block_t *prep_block;                  // The block being cut into segments
+static unsigned char prep_block_index;       // Index of prep_block in block_buffer
+static unsigned long prep_step_events;       // Step events of prep_block already in segments
+static unsigned char prep_flushes;           // The segment_buffer_flushes the preparation started from
 static long acceleration_time, deceleration_time;
-//static unsigned long accelerate_until, decelerate_after, acceleration_rate, initial_rate, final_rate, nominal_rate;
 static unsigned short acc_step_rate; // needed for deccelaration start point
-static char step_loops;
-static unsigned short OCR1A_nominal;
-static unsigned short step_loops_nominal;
+static unsigned short prep_rate;             // Step rate of the last prepared segment
+// The trapezoid of prep_block. A copy of the planned one, unless the block is entered at another rate
+// than planned or its nominal rate changed, see prep_replan_block()
+static unsigned short prep_initial_rate, prep_final_rate, prep_nominal_rate;
+static unsigned long prep_accelerate_until, prep_decelerate_after;
+static unsigned long prep_acceleration_rate; // acceleration_st in steps/s per 2^24 timer ticks
+#ifdef S_CURVE_ACCELERATION
+static bool prep_s_curve;                    // false once the planned ramps no longer apply
+static unsigned short prep_cruise_rate;      // The highest step rate of the block, where acceleration ends
+static unsigned long prep_acceleration_ticks, prep_deceleration_ticks; // Duration of the ramps in timer ticks
+static unsigned long prep_acceleration_ticks_inverse, prep_deceleration_ticks_inverse; // 2^32 / the ramp ticks
+#endif
+static bool prep_entry_changed;              // The next block is entered at prep_entry_speed instead of as planned
+static float prep_entry_speed;               // in mm/s
+
+// Feed hold, see st_feed_hold(). The hold is carried out by st_prep_buffer(), which ramps the
+// segments down to a stop behind the ones already handed to the interrupt.
+#define FEED_HOLD_OFF 0
+#define FEED_HOLD_DECELERATING 1
+#define FEED_HOLD_STOPPED 2
+#define FEED_HOLD_REQUEST 1
+#define CYCLE_START_REQUEST 2
+static volatile unsigned char hold_request;  // Set from interrupts, picked up by st_prep_buffer()
+static unsigned char hold_state = FEED_HOLD_OFF;
+static unsigned short hold_rate;             // Step rate the deceleration of the hold started from
+static bool hold_reported;                   // The host was told that the axes stand still
 
 volatile long endstops_trigsteps[3]={0,0,0};
 volatile long endstops_stepsTotal,endstops_stepsDone;
@@ -61,24 +144,70 @@ static volatile bool endstop_x_hit=false;
 static volatile bool endstop_y_hit=false;
 static volatile bool endstop_z_hit=false;
 
+#ifndef ENDSTOP_INTERRUPTS
 static bool old_x_min_endstop=false;
 static bool old_x_max_endstop=false;
 static bool old_y_min_endstop=false;
 static bool old_y_max_endstop=false;
 static bool old_z_min_endstop=false;
 static bool old_z_max_endstop=false;
+#endif
 
 static bool check_endstops = true;
 
+// Endstops the current block moves towards, set up once per block by set_stepper_directions()
+#define ENDSTOP_X_MIN 1
+#define ENDSTOP_X_MAX 2
+#define ENDSTOP_Y_MIN 4
+#define ENDSTOP_Y_MAX 8
+#define ENDSTOP_Z_MIN 16
+#define ENDSTOP_Z_MAX 32
+static unsigned char endstop_mask;
+#ifdef ENDSTOP_INTERRUPTS
+static volatile unsigned char endstop_pending;  // Endstops that stopped a block, disarmed until they read released
+static unsigned char endstop_polled;            // Endstops without an interrupt capable pin
+#endif
+
 volatile long count_position[NUM_AXIS] = { 0, 0, 0, 0};
 volatile signed char count_direction[NUM_AXIS] = { 1, 1, 1, 1};
 
+// count_position as of the end of the last segment, for the main program. The copy is written between
+// two increments of position_sequence, so the sequence is odd while it is incomplete. Readers copy the
+// position until they saw the same even sequence before and after, the interrupt never waits for them.
+static volatile long position_snapshot[NUM_AXIS] = { 0, 0, 0, 0};
+static volatile unsigned char position_sequence = 0;
+
 //===========================================================================
 //=============================functions         ============================
 //===========================================================================
 
+// Called by the stepper interrupt, or with interrupts disabled
+FORCE_INLINE void publish_position() {
+  position_sequence++;
+  position_snapshot[X_AXIS] = count_position[X_AXIS];
+  position_snapshot[Y_AXIS] = count_position[Y_AXIS];
+  position_snapshot[Z_AXIS] = count_position[Z_AXIS];
+  position_snapshot[E_AXIS] = count_position[E_AXIS];
+  position_sequence++;
+}
+
 #define CHECK_ENDSTOPS  if(check_endstops)
 
+// Bresenham increments of one pass of the line tracer
+#ifdef ADAPTIVE_STEP_SMOOTHING
+  #define TRACER_STEPS_X amass_steps_x
+  #define TRACER_STEPS_Y amass_steps_y
+  #define TRACER_STEPS_Z amass_steps_z
+  #define TRACER_STEPS_E amass_steps_e
+  #define TRACER_EVENT_COUNT amass_event_count
+#else
+  #define TRACER_STEPS_X current_block->steps_x
+  #define TRACER_STEPS_Y current_block->steps_y
+  #define TRACER_STEPS_Z current_block->steps_z
+  #define TRACER_STEPS_E current_block->steps_e
+  #define TRACER_EVENT_COUNT current_block->step_event_count
+#endif
+
 // intRes = intIn1 * intIn2 >> 16
 // uses:
 // r26 to store 0
@@ -212,33 +341,182 @@ void st_wake_up() {
   ENABLE_STEPPER_DRIVER_INTERRUPT();
 }
 
-void step_wait(){
-    for(int8_t i=0; i < 6; i++){
+// Step pulses. All axes that step in one pass of the line tracer rise together and fall together once
+// the pulse is STEP_PULSE_TICKS long. The bookkeeping of the step and the tracer pass that follows run
+// while the pins are high, so short pulses cost no waiting.
+#define STEP_PULSE_TICKS ((MINIMUM_STEPPER_PULSE * (STEPPER_TIMER_RATE/1000) + 999) / 1000) // MINIMUM_STEPPER_PULSE in timer ticks, rounded up
+
+// The step outputs grouped by port. Every output is a pin, the axis whose step bit it follows and whether
+// it is inverted. Outputs that do not exist repeat one that does, which adds nothing to the masks.
+// Which pins share a port is known at compile time from fastio.h, so every port is written once with the
+// bits of all its step pins and the masks of the other ports fold away.
+#define STEP_OUT_X X_STEP_PIN, X_AXIS, INVERT_X_STEP_PIN
+#define STEP_OUT_Y Y_STEP_PIN, Y_AXIS, INVERT_Y_STEP_PIN
+#define STEP_OUT_Z Z_STEP_PIN, Z_AXIS, INVERT_Z_STEP_PIN
+#ifdef Y_DUAL_STEPPER_DRIVERS
+  #define STEP_OUT_Y2 Y2_STEP_PIN, Y_AXIS, INVERT_Y_STEP_PIN
+#else
+  #define STEP_OUT_Y2 STEP_OUT_Y
+#endif
+#ifdef Z_DUAL_STEPPER_DRIVERS
+  #define STEP_OUT_Z2 Z2_STEP_PIN, Z_AXIS, INVERT_Z_STEP_PIN
+#else
+  #define STEP_OUT_Z2 STEP_OUT_Z
+#endif
+#if EXTRUDERS > 1
+  #define STEP_OUT_E STEP_OUT_X // The extruder step pin depends on the block, see WRITE_E_STEP
+#else
+  #define STEP_OUT_E E0_STEP_PIN, E_AXIS, INVERT_E_STEP_PIN
+#endif
+
+#define _PIN_PORT(IO) DIO ## IO ## _WPORT
+#define PIN_PORT(IO) _PIN_PORT(IO)
+#define _PIN_MASK(IO) MASK(DIO ## IO ## _PIN)
+#define PIN_MASK(IO) _PIN_MASK(IO)
+#define SAME_PORT(a, b) (&PIN_PORT(a) == &PIN_PORT(b))
+
+// The bit of an output if it is on the port of pin io, its axis is in step_bits and it is inverted as asked
+#define _STEP_OUT_MASK(io, step_bits, inverted, pin, axis, pin_inverted) \
+  ((SAME_PORT(io, pin) && ((step_bits) & (1<<(axis))) && (pin_inverted) == (inverted)) ? PIN_MASK(pin) : 0)
+#define STEP_OUT_MASK(args) _STEP_OUT_MASK args
+#define STEP_PORT_MASK(io, step_bits, inverted) (uint8_t)( \
+  STEP_OUT_MASK((io, step_bits, inverted, STEP_OUT_X)) | STEP_OUT_MASK((io, step_bits, inverted, STEP_OUT_Y)) | \
+  STEP_OUT_MASK((io, step_bits, inverted, STEP_OUT_Y2)) | STEP_OUT_MASK((io, step_bits, inverted, STEP_OUT_Z)) | \
+  STEP_OUT_MASK((io, step_bits, inverted, STEP_OUT_Z2)) | STEP_OUT_MASK((io, step_bits, inverted, STEP_OUT_E)))
+
+// Sets the step outputs of step_bits on the port of pin io to their active (or idle) level
+#define STEP_PORT_WRITE(io, step_bits, active) do { \
+    uint8_t high = STEP_PORT_MASK(io, step_bits, !(active)); \
+    uint8_t low = STEP_PORT_MASK(io, step_bits, (active)); \
+    if(high) PIN_PORT(io) |= high; \
+    if(low) PIN_PORT(io) &= ~low; \
+  } while(0)
+
+// Writes every port that has step outputs, each one with the first output on it
+#define STEP_PORTS_WRITE(step_bits, active) do { \
+    STEP_PORT_WRITE(X_STEP_PIN, step_bits, active); \
+    if(!SAME_PORT(Y_STEP_PIN, X_STEP_PIN)) \
+      STEP_PORT_WRITE(Y_STEP_PIN, step_bits, active); \
+    if(!SAME_PORT(Z_STEP_PIN, X_STEP_PIN) && !SAME_PORT(Z_STEP_PIN, Y_STEP_PIN)) \
+      STEP_PORT_WRITE(Z_STEP_PIN, step_bits, active); \
+    if(!SAME_PORT(E0_STEP_PIN, X_STEP_PIN) && !SAME_PORT(E0_STEP_PIN, Y_STEP_PIN) && !SAME_PORT(E0_STEP_PIN, Z_STEP_PIN)) \
+      STEP_PORT_WRITE(E0_STEP_PIN, step_bits, active); \
+    STEP_DUAL_PORTS_WRITE(step_bits, active); \
+  } while(0)
+
+#define FIRST_ON_PORT(io) (!SAME_PORT(io, X_STEP_PIN) && !SAME_PORT(io, Y_STEP_PIN) && \
+  !SAME_PORT(io, Z_STEP_PIN) && !SAME_PORT(io, E0_STEP_PIN))
+// Configuration_adv.h allows dual drivers for Y or for Z, so there is one more port at most
+#if defined(Y_DUAL_STEPPER_DRIVERS)
+  #define STEP_DUAL_PORTS_WRITE(step_bits, active) \
+    if(FIRST_ON_PORT(Y2_STEP_PIN)) STEP_PORT_WRITE(Y2_STEP_PIN, step_bits, active)
+#elif defined(Z_DUAL_STEPPER_DRIVERS)
+  #define STEP_DUAL_PORTS_WRITE(step_bits, active) \
+    if(FIRST_ON_PORT(Z2_STEP_PIN)) STEP_PORT_WRITE(Z2_STEP_PIN, step_bits, active)
+#else
+  #define STEP_DUAL_PORTS_WRITE(step_bits, active)
+#endif
+
+FORCE_INLINE void step_pins_high(unsigned char step_bits) {
+  STEP_PORTS_WRITE(step_bits, true);
+  #if EXTRUDERS > 1
+    if(step_bits & (1<<E_AXIS)) {
+      WRITE_E_STEP(!INVERT_E_STEP_PIN);
     }
+  #endif
+}
+
+// Takes every step pin back to its idle level. Does not look at current_block, which may be gone by now.
+FORCE_INLINE void step_pins_low() {
+  STEP_PORTS_WRITE(0xff, false);
+  #if EXTRUDERS > 1
+    WRITE(E0_STEP_PIN, INVERT_E_STEP_PIN);
+    WRITE(E1_STEP_PIN, INVERT_E_STEP_PIN);
+  #endif
+  #if EXTRUDERS > 2
+    WRITE(E2_STEP_PIN, INVERT_E_STEP_PIN);
+  #endif
+}
+
+// Waits until STEP_PULSE_TICKS have passed since start. TCNT1 starts over at 0 when it reaches OCR1A.
+FORCE_INLINE void step_pulse_wait(unsigned short start) {
+  unsigned short now;
+  do {
+    now = TCNT1;
+    if(now < start) now += OCR1A + 1;
+  } while((unsigned short)(now - start) < STEP_PULSE_TICKS);
+}
+
+// Ends the pulse that started at pulse_start. If the pulse has a while to go, the compare B interrupt
+// takes the pins low so the stepper interrupt can return right away.
+FORCE_INLINE void step_pulse_end(unsigned short pulse_start) {
+  unsigned short fall = pulse_start + STEP_PULSE_TICKS;
+  if(fall < OCR1A && TCNT1 + 4 < fall) {
+    OCR1B = fall;
+    TIFR1 = (1<<OCF1B);
+    TIMSK1 |= (1<<OCIE1B);
+  }
+  else {
+    step_pulse_wait(pulse_start);
+    step_pins_low();
+  }
 }
 
+ISR(TIMER1_COMPB_vect)
+{
+  step_pins_low();
+  TIMSK1 &= ~(1<<OCIE1B);
+}
 
-FORCE_INLINE unsigned short calc_timer(unsigned short step_rate) {
+
+#ifdef ADAPTIVE_STEP_SMOOTHING
+// Scales the Bresenham increments to one tracer event of the given level, so the counters keep
+// running in 1/AMASS_FULL_STEP of a step event whatever the level is.
+FORCE_INLINE void amass_set_level(unsigned char level) {
+  if(level == amass_level) return;
+  amass_level = level;
+  unsigned char shift = AMASS_MAX_LEVEL - level;
+  amass_phase_step = 1 << shift;
+  amass_steps_x = current_block->steps_x << shift;
+  amass_steps_y = current_block->steps_y << shift;
+  amass_steps_z = current_block->steps_z << shift;
+  amass_steps_e = current_block->steps_e << shift;
+}
+#endif
+
+// Sets the timer interval, the step loops and the smoothing level of a segment running at step_rate
+FORCE_INLINE void calc_timer(unsigned short step_rate, segment_t *segment) {
   unsigned short timer;
   if(step_rate > MAX_STEP_FREQUENCY) step_rate = MAX_STEP_FREQUENCY;
 
+  #ifdef ADAPTIVE_STEP_SMOOTHING
+    // Below 5kHz the line is traced 2, 4, .. times per step event so the slower axes step in between
+    // the steps of the dominant axis. The interrupt never runs faster than 10kHz for that. Segments
+    // end on step event boundaries, so a step event is never split across two levels.
+    unsigned char level = 0;
+    while(level < AMASS_MAX_LEVEL && step_rate <= (10000 >> (level + 1))) level++;
+    segment->amass_level = level;
+    step_rate <<= level;
+  #endif
+
   if(step_rate > 20000) { // If steprate > 20kHz >> step 4 times
     step_rate = (step_rate >> 2)&0x3fff;
-    step_loops = 4;
+    segment->step_loops = 4;
   }
   else if(step_rate > 10000) { // If steprate > 10kHz >> step 2 times
     step_rate = (step_rate >> 1)&0x7fff;
-    step_loops = 2;
+    segment->step_loops = 2;
   }
   else {
-    step_loops = 1;
+    segment->step_loops = 1;
   }
 
-  if(step_rate < (F_CPU/500000)) step_rate = (F_CPU/500000);
-  step_rate -= (F_CPU/500000); // Correct for minimal speed
+  if(step_rate < SPEED_TABLE_MIN_RATE) step_rate = SPEED_TABLE_MIN_RATE;
+  step_rate -= SPEED_TABLE_MIN_RATE; // Correct for minimal speed
   if(step_rate >= (8*256)){ // higher step rate
-    unsigned short table_address = (unsigned short)&speed_lookuptable_fast[(unsigned char)(step_rate>>8)][0];
-    unsigned char tmp_step_rate = (step_rate & 0x00ff);
+    unsigned short table_address = (unsigned short)&speed_lookuptable_fast[(unsigned char)(step_rate>>SPEED_TABLE_FAST_SHIFT)][0];
+    // The fraction of the way to the next entry, scaled to 8 bits for the multiplication
+    unsigned char tmp_step_rate = (step_rate & ((1<<SPEED_TABLE_FAST_SHIFT) - 1)) << (8 - SPEED_TABLE_FAST_SHIFT);
     unsigned short gain = (unsigned short)pgm_read_word_near(table_address+2);
     MultiU16X8toH16(timer, tmp_step_rate, gain);
     timer = (unsigned short)pgm_read_word_near(table_address) - timer;
@@ -249,319 +527,756 @@ FORCE_INLINE unsigned short calc_timer(unsigned short step_rate) {
     timer = (unsigned short)pgm_read_word_near(table_address);
     timer -= (((unsigned short)pgm_read_word_near(table_address+2) * (unsigned char)(step_rate & 0x0007))>>3);
   }
-  if(timer < 100) { timer = 100; MYSERIAL.print(MSG_STEPPER_TOO_HIGH); MYSERIAL.println(step_rate); }//(20kHz this should never happen)
-  return timer;
+  if(timer < MIN_TIMER_TICKS) { timer = MIN_TIMER_TICKS; MYSERIAL.print(MSG_STEPPER_TOO_HIGH); MYSERIAL.println(step_rate); }//(20kHz this should never happen)
+  segment->timer = timer;
 }
 
-// Initializes the trapezoid generator from the current block. Called whenever a new
+#ifdef S_CURVE_ACCELERATION
+// Rate change along a jerk limited ramp: delta_rate * s(tau), with tau the elapsed fraction of the ramp
+// as 0.32 fixed point. s(tau) = 10 tau^3 - 15 tau^4 + 6 tau^5 is the quintic Bezier curve with its
+// control points at 0,0,0,1,1,1, so the acceleration is zero at both ends of the ramp.
+FORCE_INLINE unsigned short s_curve_rate(unsigned long tau, unsigned short delta_rate)
+{
+  unsigned long t = tau >> 16;                             // 0.16 fixed point from here on
+  unsigned long t2 = (t * t) >> 16;
+  unsigned long t3 = (t2 * t) >> 16;
+  unsigned long s = t3 * (10UL*65536 - 15*t + 6*t2);       // 0.32, stays below 2^32 as s(tau) < 1
+  return ((s >> 16) * delta_rate) >> 16;
+}
+#endif
+
+#ifdef ENDSTOP_INTERRUPTS
+// Returns the ENDSTOP_* bits of the endstops that read triggered
+FORCE_INLINE unsigned char read_endstops() {
+  unsigned char triggered = 0;
+  #if defined(X_MIN_PIN) && X_MIN_PIN > -1
+    if(READ(X_MIN_PIN) != X_MIN_ENDSTOP_INVERTING) triggered |= ENDSTOP_X_MIN;
+  #endif
+  #if defined(X_MAX_PIN) && X_MAX_PIN > -1
+    if(READ(X_MAX_PIN) != X_MAX_ENDSTOP_INVERTING) triggered |= ENDSTOP_X_MAX;
+  #endif
+  #if defined(Y_MIN_PIN) && Y_MIN_PIN > -1
+    if(READ(Y_MIN_PIN) != Y_MIN_ENDSTOP_INVERTING) triggered |= ENDSTOP_Y_MIN;
+  #endif
+  #if defined(Y_MAX_PIN) && Y_MAX_PIN > -1
+    if(READ(Y_MAX_PIN) != Y_MAX_ENDSTOP_INVERTING) triggered |= ENDSTOP_Y_MAX;
+  #endif
+  #if defined(Z_MIN_PIN) && Z_MIN_PIN > -1
+    if(READ(Z_MIN_PIN) != Z_MIN_ENDSTOP_INVERTING) triggered |= ENDSTOP_Z_MIN;
+  #endif
+  #if defined(Z_MAX_PIN) && Z_MAX_PIN > -1
+    if(READ(Z_MAX_PIN) != Z_MAX_ENDSTOP_INVERTING) triggered |= ENDSTOP_Z_MAX;
+  #endif
+  return triggered;
+}
+
+// Called on every edge of an endstop pin. An endstop the current block moves towards that reads
+// triggered latches the position and ends the block right away, the next step interrupt drops the
+// rest of it. The endstop is then disarmed until endstop_debounce() sees it released.
+void endstop_pin_change() {
+  if(!check_endstops || current_block == NULL) return;
+  unsigned char hit = read_endstops() & endstop_mask & ~endstop_pending;
+  if(hit) {
+    if(hit & (ENDSTOP_X_MIN | ENDSTOP_X_MAX)) {
+      endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
+      endstop_x_hit = true;
+    }
+    if(hit & (ENDSTOP_Y_MIN | ENDSTOP_Y_MAX)) {
+      endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
+      endstop_y_hit = true;
+    }
+    if(hit & (ENDSTOP_Z_MIN | ENDSTOP_Z_MAX)) {
+      endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
+      endstop_z_hit = true;
+    }
+    step_events_completed = current_block->step_event_count;
+    endstop_pending |= hit;
+  }
+}
+
+// The pin change vectors are defined by SoftwareSerial.cpp, which calls this hook
+void pin_change_hook() {
+  endstop_pin_change();
+}
+
+// Called from the temperature interrupt at about 1kHz. Re-arms the endstops that stopped a block once
+// they read released on a tick, the edges of a switch bouncing before that are not new hits.
+// Endstops on pins without an interrupt are polled here.
+void endstop_debounce() {
+  if(endstop_pending) endstop_pending &= read_endstops();
+  if(endstop_polled & endstop_mask) endstop_pin_change();
+}
+
+// attachInterrupt() number of a pin of the Mega, -1 if it has no external interrupt
+#define EXTERNAL_INTERRUPT(pin) ((pin) == 2 ? 0 : (pin) == 3 ? 1 : ((pin) >= 18 && (pin) <= 21) ? 23 - (pin) : -1)
+
+static void setup_endstop_interrupt(unsigned char pin, unsigned char endstop) {
+  if(EXTERNAL_INTERRUPT(pin) >= 0) {
+    attachInterrupt(EXTERNAL_INTERRUPT(pin), endstop_pin_change, CHANGE);
+  }
+  else if(digitalPinToPCICR(pin) != NULL) {
+    *digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+    *digitalPinToPCICR(pin) |= _BV(digitalPinToPCICRbit(pin));
+  }
+  #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+  // D14 and D15, the Y endstops of a RAMPS, are PCINT10 and PCINT9 of port J. The Mega core does not
+  // map them, digitalPinToPCICR() returns NULL for them.
+  else if(pin == 14 || pin == 15) {
+    PCMSK1 |= _BV(pin == 14 ? PCINT10 : PCINT9);
+    PCICR |= _BV(PCIE1);
+  }
+  #endif
+  else {
+    endstop_polled |= endstop;
+  }
+}
+
+static void setup_endstop_interrupts() {
+  #if defined(X_MIN_PIN) && X_MIN_PIN > -1
+    setup_endstop_interrupt(X_MIN_PIN, ENDSTOP_X_MIN);
+  #endif
+  #if defined(X_MAX_PIN) && X_MAX_PIN > -1
+    setup_endstop_interrupt(X_MAX_PIN, ENDSTOP_X_MAX);
+  #endif
+  #if defined(Y_MIN_PIN) && Y_MIN_PIN > -1
+    setup_endstop_interrupt(Y_MIN_PIN, ENDSTOP_Y_MIN);
+  #endif
+  #if defined(Y_MAX_PIN) && Y_MAX_PIN > -1
+    setup_endstop_interrupt(Y_MAX_PIN, ENDSTOP_Y_MAX);
+  #endif
+  #if defined(Z_MIN_PIN) && Z_MIN_PIN > -1
+    setup_endstop_interrupt(Z_MIN_PIN, ENDSTOP_Z_MIN);
+  #endif
+  #if defined(Z_MAX_PIN) && Z_MAX_PIN > -1
+    setup_endstop_interrupt(Z_MAX_PIN, ENDSTOP_Z_MAX);
+  #endif
+}
+#else
+// Reads the endstops in endstop_mask. An endstop has to read triggered twice in a row, then the
+// position is latched and the rest of the block is skipped.
+#define UPDATE_ENDSTOP(axis, AXIS, minmax, MINMAX) \
+  if(endstop_mask & ENDSTOP_##AXIS##_##MINMAX) { \
+    bool axis##_##minmax##_endstop = (READ(AXIS##_##MINMAX##_PIN) != AXIS##_##MINMAX##_ENDSTOP_INVERTING); \
+    if(axis##_##minmax##_endstop && old_##axis##_##minmax##_endstop) { \
+      endstops_trigsteps[AXIS##_AXIS] = count_position[AXIS##_AXIS]; \
+      endstop_##axis##_hit = true; \
+      step_events_completed = current_block->step_event_count; \
+    } \
+    old_##axis##_##minmax##_endstop = axis##_##minmax##_endstop; \
+  }
+
+FORCE_INLINE void update_endstops() {
+  #if defined(X_MIN_PIN) && X_MIN_PIN > -1
+    UPDATE_ENDSTOP(x, X, min, MIN);
+  #endif
+  #if defined(X_MAX_PIN) && X_MAX_PIN > -1
+    UPDATE_ENDSTOP(x, X, max, MAX);
+  #endif
+  #if defined(Y_MIN_PIN) && Y_MIN_PIN > -1
+    UPDATE_ENDSTOP(y, Y, min, MIN);
+  #endif
+  #if defined(Y_MAX_PIN) && Y_MAX_PIN > -1
+    UPDATE_ENDSTOP(y, Y, max, MAX);
+  #endif
+  #if defined(Z_MIN_PIN) && Z_MIN_PIN > -1
+    UPDATE_ENDSTOP(z, Z, min, MIN);
+  #endif
+  #if defined(Z_MAX_PIN) && Z_MAX_PIN > -1
+    UPDATE_ENDSTOP(z, Z, max, MAX);
+  #endif
+}
+#endif
+
+// Sets the direction pins for the current block and selects the endstops it can run into. The
+// pins do not change during a block, so this is done once instead of on every step.
+FORCE_INLINE void set_stepper_directions() {
+  out_bits = current_block->direction_bits;
+  endstop_mask = 0;
+
+  // Set the direction bits (X_AXIS=A_AXIS and Y_AXIS=B_AXIS for COREXY)
+  if((out_bits & (1<<X_AXIS))!=0){   // stepping along -X axis
+    WRITE(X_DIR_PIN, INVERT_X_DIR);
+    count_direction[X_AXIS]=-1;
+    if(current_block->steps_x > 0) endstop_mask |= ENDSTOP_X_MIN;
+  }
+  else{ // +direction
+    WRITE(X_DIR_PIN, !INVERT_X_DIR);
+    count_direction[X_AXIS]=1;
+    if(current_block->steps_x > 0) endstop_mask |= ENDSTOP_X_MAX;
+  }
+
+  if((out_bits & (1<<Y_AXIS))!=0){   // -direction
+    WRITE(Y_DIR_PIN, INVERT_Y_DIR);
+
+    #ifdef Y_DUAL_STEPPER_DRIVERS
+      WRITE(Y2_DIR_PIN, !(INVERT_Y_DIR == INVERT_Y2_VS_Y_DIR));
+    #endif
+
+    count_direction[Y_AXIS]=-1;
+    if(current_block->steps_y > 0) endstop_mask |= ENDSTOP_Y_MIN;
+  }
+  else{ // +direction
+    WRITE(Y_DIR_PIN, !INVERT_Y_DIR);
+
+    #ifdef Y_DUAL_STEPPER_DRIVERS
+      WRITE(Y2_DIR_PIN, (INVERT_Y_DIR == INVERT_Y2_VS_Y_DIR));
+    #endif
+
+    count_direction[Y_AXIS]=1;
+    if(current_block->steps_y > 0) endstop_mask |= ENDSTOP_Y_MAX;
+  }
+
+  if((out_bits & (1<<Z_AXIS))!=0){   // -direction
+    WRITE(Z_DIR_PIN,INVERT_Z_DIR);
+
+    #ifdef Z_DUAL_STEPPER_DRIVERS
+      WRITE(Z2_DIR_PIN,INVERT_Z_DIR);
+    #endif
+
+    count_direction[Z_AXIS]=-1;
+    if(current_block->steps_z > 0) endstop_mask |= ENDSTOP_Z_MIN;
+  }
+  else{ // +direction
+    WRITE(Z_DIR_PIN,!INVERT_Z_DIR);
+
+    #ifdef Z_DUAL_STEPPER_DRIVERS
+      WRITE(Z2_DIR_PIN,!INVERT_Z_DIR);
+    #endif
+
+    count_direction[Z_AXIS]=1;
+    if(current_block->steps_z > 0) endstop_mask |= ENDSTOP_Z_MAX;
+  }
+
+  if((out_bits & (1<<E_AXIS))!=0){   // -direction
+    REV_E_DIR();
+    count_direction[E_AXIS]=-1;
+  }
+  else{ // +direction
+    NORM_E_DIR();
+    count_direction[E_AXIS]=1;
+  }
+
+  #ifdef ENDSTOP_INTERRUPTS
+    // An endstop that is already pressed gives no edge
+    endstop_pending = 0;
+    endstop_pin_change();
+  #endif
+}
+
+// Initializes the trapezoid generator from prep_block. Called whenever the preparation of a new
 // block begins.
 FORCE_INLINE void trapezoid_generator_reset() {
+  prep_step_events = 0;
+  acceleration_time = 0;
   deceleration_time = 0;
-  // step_rate to timer interval
-  OCR1A_nominal = calc_timer(current_block->nominal_rate);
-  // make a note of the number of step loops required at nominal speed
-  step_loops_nominal = step_loops;
-  acc_step_rate = current_block->initial_rate;
-  acceleration_time = calc_timer(acc_step_rate);
-  OCR1A = acceleration_time;
-
-//    SERIAL_ECHO_START;
-//    SERIAL_ECHOPGM("advance :");
-//    SERIAL_ECHO(current_block->advance/256.0);
-//    SERIAL_ECHOPGM("advance rate :");
-//    SERIAL_ECHO(current_block->advance_rate/256.0);
-//    SERIAL_ECHOPGM("initial advance :");
-//  SERIAL_ECHO(current_block->initial_advance/256.0);
-//    SERIAL_ECHOPGM("final advance :");
-//    SERIAL_ECHOLN(current_block->final_advance/256.0);
-
+  acc_step_rate = prep_block->initial_rate;
+  prep_initial_rate = prep_block->initial_rate;
+  prep_final_rate = prep_block->final_rate;
+  prep_nominal_rate = prep_block->nominal_rate;
+  prep_accelerate_until = prep_block->accelerate_until;
+  prep_decelerate_after = prep_block->decelerate_after;
+  prep_acceleration_rate = (unsigned long)((float)prep_block->acceleration_st * (16777216.0 / STEPPER_TIMER_RATE));
+  #ifdef S_CURVE_ACCELERATION
+    // The S-curve ramps last as long as the linear ramps would. Worked out here once per block rather
+    // than stored in block_t. The rate changes by acceleration_st/STEPPER_TIMER_RATE per tick.
+    prep_s_curve = true;
+    unsigned long cruise_rate = prep_nominal_rate;
+    if(prep_accelerate_until == prep_decelerate_after) { // No plateau
+      cruise_rate = min(cruise_rate, (unsigned long)sqrt((float)prep_initial_rate*prep_initial_rate
+                                                         + 2.0*prep_block->acceleration_st*prep_accelerate_until));
+    }
+    prep_cruise_rate = max(cruise_rate, (unsigned long)max(prep_initial_rate, prep_final_rate));
+    float ticks_per_rate = (float)STEPPER_TIMER_RATE / prep_block->acceleration_st;
+    prep_acceleration_ticks = (prep_cruise_rate - prep_initial_rate) * ticks_per_rate;
+    prep_deceleration_ticks = (prep_cruise_rate - prep_final_rate) * ticks_per_rate;
+    prep_acceleration_ticks_inverse = prep_acceleration_ticks ? 0xFFFFFFFFUL / prep_acceleration_ticks : 0;
+    prep_deceleration_ticks_inverse = prep_deceleration_ticks ? 0xFFFFFFFFUL / prep_deceleration_ticks : 0;
+  #endif
 }
 
-// "The Stepper Driver Interrupt" - This timer interrupt is the workhorse.
-// It pops blocks from the block_buffer and executes them by pulsing the stepper pins appropriately.
-ISR(TIMER1_COMPA_vect)
+// Plans the rest of prep_block from prep_step_events on, entered at entry_rate instead of the planned
+// rate: accelerate (or slow down) to nominal_rate, then decelerate to final_rate. If the remaining steps
+// do not allow that, the exit rate is the closest to final_rate they do allow. The ramps are linear.
+static void prep_replan_block(unsigned short entry_rate)
 {
-  // If there is no current block, attempt to pop one from the buffer
-  if (current_block == NULL) {
-    // Anything in the buffer?
-    current_block = plan_get_current_block();
-    if (current_block != NULL) {
-      current_block->busy = true;
-      trapezoid_generator_reset();
-      counter_x = -(current_block->step_event_count >> 1);
-      counter_y = counter_x;
-      counter_z = counter_x;
-      counter_e = counter_x;
-      step_events_completed = 0;
-
-      #ifdef Z_LATE_ENABLE
-        if(current_block->steps_z > 0) {
-          enable_z();
-          OCR1A = 2000; //1ms wait
-          return;
-        }
-      #endif
+  if(entry_rate < 120) entry_rate = 120;
+  float steps = prep_block->step_event_count - prep_step_events;
+  float twice_accel = 2.0 * prep_block->acceleration_st;
+  float nominal_sqr = square((float)prep_block->nominal_rate);
+  float entry_sqr = square((float)entry_rate);
+  float exit_sqr = square((float)min(prep_block->final_rate, prep_block->nominal_rate));
+  if(exit_sqr > entry_sqr + twice_accel * steps) exit_sqr = entry_sqr + twice_accel * steps;
+  if(exit_sqr < entry_sqr - twice_accel * steps) exit_sqr = entry_sqr - twice_accel * steps;
+
+  // The first phase runs from entry_rate to nominal_rate. Above nominal_rate it slows down.
+  float accelerate = ceil(fabs(nominal_sqr - entry_sqr) / twice_accel);
+  float decelerate = floor((nominal_sqr - exit_sqr) / twice_accel);
+  if(decelerate < 0) decelerate = 0;
+  if(accelerate + decelerate > steps) {
+    if(entry_rate > prep_block->nominal_rate) {
+      // No room to cruise, decelerate all the way
+      accelerate = 0;
+      decelerate = steps;
     }
     else {
-        OCR1A=2000; // 1kHz.
+      // No time to reach nominal_rate, accelerate until the deceleration to the exit rate has to begin
+      accelerate = ceil(((exit_sqr - entry_sqr) / twice_accel + steps) / 2.0);
+      if(accelerate < 0) accelerate = 0;
+      if(accelerate > steps) accelerate = steps;
+      decelerate = steps - accelerate;
     }
   }
 
-  if (current_block != NULL) {
-    // Set directions TO DO This should be done once during init of trapezoid. Endstops -> interrupt
-    out_bits = current_block->direction_bits;
+  prep_initial_rate = entry_rate;
+  prep_final_rate = sqrt(exit_sqr) + 0.5;
+  prep_nominal_rate = prep_block->nominal_rate;
+  prep_accelerate_until = prep_step_events + (unsigned long)accelerate;
+  prep_decelerate_after = prep_block->step_event_count - (unsigned long)decelerate;
+  acceleration_time = 0;
+  deceleration_time = 0;
+  acc_step_rate = entry_rate;
+  #ifdef S_CURVE_ACCELERATION
+    prep_s_curve = false;
+  #endif
+}
+
+// Starts the deceleration of a feed hold from the rate the preparation is at
+static void start_feed_hold()
+{
+  hold_reported = false;
+  if(prep_block != NULL) {
+    hold_rate = prep_rate;
+    deceleration_time = 0;
+    hold_state = FEED_HOLD_DECELERATING;
+  }
+  else if(prep_block_index != block_buffer_head) {
+    hold_rate = 0; // The next block sets the rate to decelerate from
+    hold_state = FEED_HOLD_DECELERATING;
+  }
+  else {
+    // Everything prepared ends at standstill anyway
+    hold_state = FEED_HOLD_STOPPED;
+  }
+}
 
+// Continues the plan after a feed hold, from standstill or from the rate the hold got down to
+static void end_feed_hold()
+{
+  bool stopped = (hold_state == FEED_HOLD_STOPPED);
+  hold_state = FEED_HOLD_OFF;
+  if(prep_block != NULL) {
+    prep_replan_block(stopped ? 0 : prep_rate);
+  }
+  else if(stopped) {
+    prep_entry_changed = true;
+    prep_entry_speed = 0;
+  }
+}
 
-    // Set the direction bits (X_AXIS=A_AXIS and Y_AXIS=B_AXIS for COREXY)
-    if((out_bits & (1<<X_AXIS))!=0){
-        WRITE(X_DIR_PIN, INVERT_X_DIR); 
-      count_direction[X_AXIS]=-1;
-    }
-    else{
-        WRITE(X_DIR_PIN, !INVERT_X_DIR);     
-      count_direction[X_AXIS]=1;
-    }
-    if((out_bits & (1<<Y_AXIS))!=0){
-      WRITE(Y_DIR_PIN, INVERT_Y_DIR);
-	  
-	  #ifdef Y_DUAL_STEPPER_DRIVERS
-	    WRITE(Y2_DIR_PIN, !(INVERT_Y_DIR == INVERT_Y2_VS_Y_DIR));
-	  #endif
-	  
-      count_direction[Y_AXIS]=-1;
+// Cuts the planned blocks into segments of constant step rate until the segment buffer is full. This
+// is the acceleration math the interrupt used to do on every step: a segment lasts at most
+// SEGMENT_TIME (or one step) and runs at the rate the ramp has halfway through it.
+// Called from loop() and every wait loop through manage_inactivity(). A block is busy from the
+// moment its first segment is cut.
+// A feed hold replaces the planned profile with a deceleration at the block's acceleration. The
+// segments already in the buffer still run as planned, so the hold begins at most SEGMENT_BUFFER_SIZE
+// segments after it was requested. The rest of the plan stays in the buffer, on cycle start the block
+// the hold ended in is replanned from standstill.
+void st_prep_buffer()
+{
+  if(hold_request) {
+    CRITICAL_SECTION_START;
+    unsigned char request = hold_request;
+    hold_request = 0;
+    CRITICAL_SECTION_END;
+    if(request == FEED_HOLD_REQUEST && hold_state == FEED_HOLD_OFF) {
+      start_feed_hold();
     }
-    else{
-      WRITE(Y_DIR_PIN, !INVERT_Y_DIR);
-	  
-	  #ifdef Y_DUAL_STEPPER_DRIVERS
-	    WRITE(Y2_DIR_PIN, (INVERT_Y_DIR == INVERT_Y2_VS_Y_DIR));
-	  #endif
-	  
-      count_direction[Y_AXIS]=1;
+    else if(request == CYCLE_START_REQUEST && hold_state != FEED_HOLD_OFF) {
+      end_feed_hold();
     }
+  }
 
-    // Set direction en check limit switches
-    if ((out_bits & (1<<X_AXIS)) != 0) {   // stepping along -X axis
-      CHECK_ENDSTOPS
-      {    
-        {
-          #if defined(X_MIN_PIN) && X_MIN_PIN > -1
-            bool x_min_endstop=(READ(X_MIN_PIN) != X_MIN_ENDSTOP_INVERTING);
-            if(x_min_endstop && old_x_min_endstop && (current_block->steps_x > 0)) {
-              endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
-              endstop_x_hit=true;
-              step_events_completed = current_block->step_event_count;
-            }
-            old_x_min_endstop = x_min_endstop;
-          #endif
-        }
-      }
+  for(;;) {
+    if(prep_flushes != segment_buffer_flushes) {
+      // The interrupt ended a block early and dropped all segments, start over at the new tail. The
+      // axes stopped dead, so the next block begins from standstill.
+      prep_flushes = segment_buffer_flushes;
+      prep_block = NULL;
+      prep_block_index = block_buffer_tail;
+      prep_entry_changed = true;
+      prep_entry_speed = 0;
+      if(hold_state == FEED_HOLD_DECELERATING) hold_state = FEED_HOLD_STOPPED;
     }
-    else { // +direction
-      CHECK_ENDSTOPS
-      {
-        {
-          #if defined(X_MAX_PIN) && X_MAX_PIN > -1
-            bool x_max_endstop=(READ(X_MAX_PIN) != X_MAX_ENDSTOP_INVERTING);
-            if(x_max_endstop && old_x_max_endstop && (current_block->steps_x > 0)){
-              endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
-              endstop_x_hit=true;
-              step_events_completed = current_block->step_event_count;
-            }
-            old_x_max_endstop = x_max_endstop;
-          #endif
-        }
+    if(hold_state == FEED_HOLD_STOPPED) {
+      if(!hold_reported && segment_buffer_head == segment_buffer_tail) {
+        hold_reported = true;
+        SERIAL_ECHO_START;
+        SERIAL_ECHOLNPGM(MSG_FEED_HOLD);
       }
+      return;
     }
+    unsigned char next_head = (segment_buffer_head + 1) & (SEGMENT_BUFFER_SIZE - 1);
+    if(next_head == segment_buffer_tail) return; // The buffer is full
+
+    if(prep_block == NULL) {
+      prep_block = plan_get_block(prep_block_index);
+      if(prep_block == NULL) {
+        // Everything planned is prepared and ends at standstill, so does a hold. The next block to
+        // arrive starts from standstill too.
+        if(hold_state == FEED_HOLD_DECELERATING) hold_state = FEED_HOLD_STOPPED;
+        prep_entry_changed = true;
+        prep_entry_speed = 0;
+        return;
+      }
+      trapezoid_generator_reset();
 
-    if ((out_bits & (1<<Y_AXIS)) != 0) {   // -direction
-      CHECK_ENDSTOPS
-      {
-        #if defined(Y_MIN_PIN) && Y_MIN_PIN > -1
-          bool y_min_endstop=(READ(Y_MIN_PIN) != Y_MIN_ENDSTOP_INVERTING);
-          if(y_min_endstop && old_y_min_endstop && (current_block->steps_y > 0)) {
-            endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
-            endstop_y_hit=true;
-            step_events_completed = current_block->step_event_count;
-          }
-          old_y_min_endstop = y_min_endstop;
-        #endif
+      unsigned short entry_rate = prep_block->initial_rate;
+      if(prep_entry_changed) {
+        // The previous block did not end at the planned junction speed
+        prep_entry_changed = false;
+        entry_rate = min(prep_entry_speed * prep_block->nominal_rate / prep_block->nominal_speed, 65535.0);
       }
-    }
-    else { // +direction
-      CHECK_ENDSTOPS
-      {
-        #if defined(Y_MAX_PIN) && Y_MAX_PIN > -1
-          bool y_max_endstop=(READ(Y_MAX_PIN) != Y_MAX_ENDSTOP_INVERTING);
-          if(y_max_endstop && old_y_max_endstop && (current_block->steps_y > 0)){
-            endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
-            endstop_y_hit=true;
-            step_events_completed = current_block->step_event_count;
-          }
-          old_y_max_endstop = y_max_endstop;
-        #endif
+      if(hold_state == FEED_HOLD_DECELERATING) {
+        hold_rate = entry_rate;
+        deceleration_time = 0;
+      }
+      else if(entry_rate != prep_block->initial_rate) {
+        prep_replan_block(entry_rate);
       }
     }
+    else if(prep_nominal_rate != prep_block->nominal_rate && hold_state == FEED_HOLD_OFF) {
+      // The feed override changed, continue from the current rate towards the new nominal rate
+      prep_replan_block(prep_rate);
+    }
 
-    if ((out_bits & (1<<Z_AXIS)) != 0) {   // -direction
-      WRITE(Z_DIR_PIN,INVERT_Z_DIR);
-      
-      #ifdef Z_DUAL_STEPPER_DRIVERS
-        WRITE(Z2_DIR_PIN,INVERT_Z_DIR);
-      #endif
-
-      count_direction[Z_AXIS]=-1;
-      CHECK_ENDSTOPS
-      {
-        #if defined(Z_MIN_PIN) && Z_MIN_PIN > -1
-          bool z_min_endstop=(READ(Z_MIN_PIN) != Z_MIN_ENDSTOP_INVERTING);
-          if(z_min_endstop && old_z_min_endstop && (current_block->steps_z > 0)) {
-            endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
-            endstop_z_hit=true;
-            step_events_completed = current_block->step_event_count;
-          }
-          old_z_min_endstop = z_min_endstop;
-        #endif
+    segment_t *segment = &segment_buffer[segment_buffer_head];
+    unsigned long phase_end;
+    unsigned long ramp_time;
+    unsigned short step_rate;
+    long *ramp_clock = NULL; // The ramp time to advance by the duration of the segment
+    if(hold_state == FEED_HOLD_DECELERATING) {
+      phase_end = prep_block->step_event_count;
+      ramp_time = deceleration_time + SEGMENT_TICKS/2;
+      MultiU24X24toH16(step_rate, ramp_time, prep_acceleration_rate);
+      if(step_rate + 120 >= hold_rate) {
+        // Slow enough to stop dead, the interrupt idles once it ran out of segments
+        hold_state = FEED_HOLD_STOPPED;
+        continue;
       }
+      step_rate = hold_rate - step_rate;
+      ramp_clock = &deceleration_time;
     }
-    else { // +direction
-      WRITE(Z_DIR_PIN,!INVERT_Z_DIR);
-
-      #ifdef Z_DUAL_STEPPER_DRIVERS
-        WRITE(Z2_DIR_PIN,!INVERT_Z_DIR);
+    else if(prep_step_events < prep_accelerate_until) {
+      phase_end = prep_accelerate_until;
+      ramp_time = acceleration_time + SEGMENT_TICKS/2;
+      #ifdef S_CURVE_ACCELERATION
+      if(prep_s_curve) {
+        if(ramp_time < prep_acceleration_ticks) {
+          step_rate = prep_initial_rate + s_curve_rate(ramp_time * prep_acceleration_ticks_inverse,
+                                                       prep_cruise_rate - prep_initial_rate);
+        }
+        else {
+          step_rate = prep_cruise_rate;
+        }
+      }
+      else
       #endif
-
-      count_direction[Z_AXIS]=1;
-      CHECK_ENDSTOPS
       {
-        #if defined(Z_MAX_PIN) && Z_MAX_PIN > -1
-          bool z_max_endstop=(READ(Z_MAX_PIN) != Z_MAX_ENDSTOP_INVERTING);
-          if(z_max_endstop && old_z_max_endstop && (current_block->steps_z > 0)) {
-            endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
-            endstop_z_hit=true;
-            step_events_completed = current_block->step_event_count;
-          }
-          old_z_max_endstop = z_max_endstop;
-        #endif
+        MultiU24X24toH16(step_rate, ramp_time, prep_acceleration_rate);
+        if(prep_initial_rate > prep_block->nominal_rate) {
+          // Slowing down to a lowered nominal rate
+          if(step_rate < prep_initial_rate - prep_block->nominal_rate)
+            step_rate = prep_initial_rate - step_rate;
+          else
+            step_rate = prep_block->nominal_rate;
+        }
+        else {
+          step_rate += prep_initial_rate;
+        }
       }
-    }
 
-      if ((out_bits & (1<<E_AXIS)) != 0) {  // -direction
-        REV_E_DIR();
-        count_direction[E_AXIS]=-1;
-      }
-      else { // +direction
-        NORM_E_DIR();
-        count_direction[E_AXIS]=1;
+      // upper limit
+      if(step_rate > prep_block->nominal_rate)
+        step_rate = prep_block->nominal_rate;
+      acc_step_rate = step_rate;
+      ramp_clock = &acceleration_time;
+    }
+    else if(prep_step_events >= prep_decelerate_after) {
+      phase_end = prep_block->step_event_count;
+      ramp_time = deceleration_time + SEGMENT_TICKS/2;
+      #ifdef S_CURVE_ACCELERATION
+      if(prep_s_curve) {
+        if((ramp_time < prep_deceleration_ticks) && (acc_step_rate > prep_final_rate)) {
+          step_rate = acc_step_rate - s_curve_rate(ramp_time * prep_deceleration_ticks_inverse,
+                                                   acc_step_rate - prep_final_rate);
+        }
+        else {
+          step_rate = prep_final_rate;
+        }
       }
-
-
-
-    for(int8_t i=0; i < step_loops; i++) { // Take multiple steps per interrupt (For high speed moves)
-      #ifndef AT90USB
-      MSerial.checkRx(); // Check for serial chars.
+      else
       #endif
-        counter_x += current_block->steps_x;
-        if (counter_x > 0) {
-          WRITE(X_STEP_PIN, !INVERT_X_STEP_PIN);      
-          counter_x -= current_block->step_event_count;
-          count_position[X_AXIS]+=count_direction[X_AXIS];   
-          WRITE(X_STEP_PIN, INVERT_X_STEP_PIN);
-        }
+      {
+        MultiU24X24toH16(step_rate, ramp_time, prep_acceleration_rate);
 
-        counter_y += current_block->steps_y;
-        if (counter_y > 0) {
-          WRITE(Y_STEP_PIN, !INVERT_Y_STEP_PIN);
-		  
-		  #ifdef Y_DUAL_STEPPER_DRIVERS
-			WRITE(Y2_STEP_PIN, !INVERT_Y_STEP_PIN);
-		  #endif
-		  
-          counter_y -= current_block->step_event_count;
-          count_position[Y_AXIS]+=count_direction[Y_AXIS];
-          WRITE(Y_STEP_PIN, INVERT_Y_STEP_PIN);
-		  
-		  #ifdef Y_DUAL_STEPPER_DRIVERS
-			WRITE(Y2_STEP_PIN, INVERT_Y_STEP_PIN);
-		  #endif
+        if(step_rate > acc_step_rate) { // Check step_rate stays positive
+          step_rate = prep_final_rate;
+        }
+        else {
+          step_rate = acc_step_rate - step_rate; // Decelerate from aceleration end point.
         }
-
-      counter_z += current_block->steps_z;
-      if (counter_z > 0) {
-        WRITE(Z_STEP_PIN, !INVERT_Z_STEP_PIN);
-        
-        #ifdef Z_DUAL_STEPPER_DRIVERS
-          WRITE(Z2_STEP_PIN, !INVERT_Z_STEP_PIN);
-        #endif
-
-        counter_z -= current_block->step_event_count;
-        count_position[Z_AXIS]+=count_direction[Z_AXIS];
-        WRITE(Z_STEP_PIN, INVERT_Z_STEP_PIN);
-        
-        #ifdef Z_DUAL_STEPPER_DRIVERS
-          WRITE(Z2_STEP_PIN, INVERT_Z_STEP_PIN);
-        #endif
       }
 
-        counter_e += current_block->steps_e;
-        if (counter_e > 0) {
-          WRITE_E_STEP(!INVERT_E_STEP_PIN);
-          counter_e -= current_block->step_event_count;
-          count_position[E_AXIS]+=count_direction[E_AXIS];
-          WRITE_E_STEP(INVERT_E_STEP_PIN);
-        }
-      step_events_completed += 1;
-      if(step_events_completed >= current_block->step_event_count) break;
+      // lower limit
+      if(step_rate < prep_final_rate)
+        step_rate = prep_final_rate;
+      ramp_clock = &deceleration_time;
     }
-    // Calculare new timer value
-    unsigned short timer;
-    unsigned short step_rate;
-    if (step_events_completed <= (unsigned long int)current_block->accelerate_until) {
-
-      MultiU24X24toH16(acc_step_rate, acceleration_time, current_block->acceleration_rate);
-      acc_step_rate += current_block->initial_rate;
+    else {
+      phase_end = prep_decelerate_after;
+      step_rate = prep_block->nominal_rate;
+      acc_step_rate = step_rate;
+    }
+    prep_rate = step_rate;
 
-      // upper limit
-      if(acc_step_rate > current_block->nominal_rate)
-        acc_step_rate = current_block->nominal_rate;
+    // step_rate to timer interval, then as many step events as fit in SEGMENT_TIME
+    calc_timer(step_rate, segment);
+    unsigned long event_ticks = segment->timer / segment->step_loops;
+    #ifdef ADAPTIVE_STEP_SMOOTHING
+      event_ticks <<= segment->amass_level;
+    #endif
+    unsigned long step_events = SEGMENT_TICKS / event_ticks;
+    if(step_events == 0) step_events = 1;
+    if(step_events > phase_end - prep_step_events) step_events = phase_end - prep_step_events;
+    segment->step_events = step_events;
+
+    if(ramp_clock != NULL) *ramp_clock += step_events * event_ticks;
+    prep_step_events += step_events;
+    segment->end_of_block = (prep_step_events >= prep_block->step_event_count);
+
+    // Hand the segment to the interrupt, unless it dropped the buffer in the meantime
+    CRITICAL_SECTION_START;
+    if(prep_flushes == segment_buffer_flushes) segment_buffer_head = next_head;
+    CRITICAL_SECTION_END;
+
+    if(segment->end_of_block) {
+      // A hold or a replanned block may not leave at the speed the next block expects to be entered at
+      if(hold_state == FEED_HOLD_DECELERATING || prep_final_rate != prep_block->final_rate) {
+        prep_entry_changed = true;
+        prep_entry_speed = step_rate * prep_block->nominal_speed / prep_block->nominal_rate;
+      }
+      prep_block = NULL;
+      prep_block_index = (prep_block_index + 1) & (BLOCK_BUFFER_SIZE - 1);
+    }
+  }
+}
 
-      // step_rate to timer interval
-      timer = calc_timer(acc_step_rate);
-      OCR1A = timer;
-      acceleration_time += timer;
+// "The Stepper Driver Interrupt" - This timer interrupt is the workhorse.
+// It pops the segments prepared by st_prep_buffer() and executes them by pulsing the stepper pins
+// appropriately. The step rate of a segment is fixed, the only math left here is the line tracer.
+FORCE_INLINE void stepper_isr()
+{
+  // If there is no current segment, attempt to pop one from the buffer
+  if (current_segment == NULL) {
+    // Anything prepared?
+    if (segment_buffer_head == segment_buffer_tail) {
+      OCR1A=STEPPER_TIMER_RATE/1000; // 1kHz.
+      return;
     }
-    else if (step_events_completed > (unsigned long int)current_block->decelerate_after) {
-      MultiU24X24toH16(step_rate, deceleration_time, current_block->acceleration_rate);
+    current_segment = &segment_buffer[segment_buffer_tail];
+    segment_steps_left = current_segment->step_events;
+    step_loops = current_segment->step_loops;
+    OCR1A = current_segment->timer;
+
+    // The first segment of a block sets up the line tracer
+    if (current_block == NULL) {
+      current_block = plan_get_current_block();
+      set_stepper_directions();
+      #ifdef ADAPTIVE_STEP_SMOOTHING
+        amass_event_count = current_block->step_event_count << AMASS_MAX_LEVEL;
+        amass_phase = 0;
+        amass_level = 0xff; // force amass_set_level() to scale the new block
+        counter_x = -(amass_event_count >> 1);
+      #else
+        counter_x = -(current_block->step_event_count >> 1);
+      #endif
+      counter_y = counter_x;
+      counter_z = counter_x;
+      counter_e = counter_x;
+      step_events_completed = 0;
+    }
+    #ifdef ADAPTIVE_STEP_SMOOTHING
+      amass_set_level(current_segment->amass_level);
+    #endif
 
-      if(step_rate > acc_step_rate) { // Check step_rate stays positive
-        step_rate = current_block->final_rate;
-      }
-      else {
-        step_rate = acc_step_rate - step_rate; // Decelerate from aceleration end point.
+    #ifdef Z_LATE_ENABLE
+      if(step_events_completed == 0 && current_block->steps_z > 0) {
+        enable_z();
+        OCR1A = STEPPER_TIMER_RATE/1000; //1ms wait
+        return;
       }
+    #endif
+  }
 
-      // lower limit
-      if(step_rate < current_block->final_rate)
-        step_rate = current_block->final_rate;
+  // The direction pins and the endstops to watch were set up when the block was loaded
+  #ifndef ENDSTOP_INTERRUPTS
+  CHECK_ENDSTOPS
+  {
+    if(endstop_mask) update_endstops();
+  }
+  #endif
+
+  if(TIMSK1 & (1<<OCIE1B)) {
+    // The compare B interrupt did not get to end the last pulse yet
+    step_pins_low();
+    TIMSK1 &= ~(1<<OCIE1B);
+    step_pulse_wait(TCNT1);
+  }
 
-      // step_rate to timer interval
-      timer = calc_timer(step_rate);
-      OCR1A = timer;
-      deceleration_time += timer;
+  bool pulse_pending = false;  // The step pins are high since pulse_start
+  unsigned short pulse_start = 0;
+  for(int8_t i=0; i < step_loops; i++) { // Take multiple steps per interrupt (For high speed moves)
+    #ifndef AT90USB
+    MSerial.checkRx(); // Check for serial chars.
+    #endif
+    unsigned char step_bits = 0;
+    counter_x += TRACER_STEPS_X;
+    if (counter_x > 0) {
+      counter_x -= TRACER_EVENT_COUNT;
+      step_bits |= (1<<X_AXIS);
     }
-    else {
-      OCR1A = OCR1A_nominal;
-      // ensure we're running at the correct step rate, even if we just came off an acceleration
-      step_loops = step_loops_nominal;
+    counter_y += TRACER_STEPS_Y;
+    if (counter_y > 0) {
+      counter_y -= TRACER_EVENT_COUNT;
+      step_bits |= (1<<Y_AXIS);
+    }
+    counter_z += TRACER_STEPS_Z;
+    if (counter_z > 0) {
+      counter_z -= TRACER_EVENT_COUNT;
+      step_bits |= (1<<Z_AXIS);
+    }
+    counter_e += TRACER_STEPS_E;
+    if (counter_e > 0) {
+      counter_e -= TRACER_EVENT_COUNT;
+      step_bits |= (1<<E_AXIS);
     }
 
+    if (step_bits) {
+      if (pulse_pending) {
+        // End the previous pulse and keep the pins low for as long before the next one
+        step_pulse_wait(pulse_start);
+        step_pins_low();
+        step_pulse_wait(TCNT1);
+      }
+      step_pins_high(step_bits);
+      pulse_start = TCNT1;
+      pulse_pending = true;
+      if (step_bits & (1<<X_AXIS)) count_position[X_AXIS]+=count_direction[X_AXIS];
+      if (step_bits & (1<<Y_AXIS)) count_position[Y_AXIS]+=count_direction[Y_AXIS];
+      if (step_bits & (1<<Z_AXIS)) count_position[Z_AXIS]+=count_direction[Z_AXIS];
+      if (step_bits & (1<<E_AXIS)) count_position[E_AXIS]+=count_direction[E_AXIS];
+    }
+    #ifdef ADAPTIVE_STEP_SMOOTHING
+      amass_phase += amass_phase_step;
+      if(amass_phase < AMASS_FULL_STEP) continue;
+      amass_phase = 0;
+    #endif
+    step_events_completed += 1;
+    #ifdef ISR_PROFILING
+      stepper_isr_profile.total_events++;
+    #endif
+    segment_steps_left--;
+    if(segment_steps_left == 0 || step_events_completed >= current_block->step_event_count) break;
+  }
+  if (pulse_pending) step_pulse_end(pulse_start);
+
+  // The segment is done, or an endstop ended the block early
+  if (segment_steps_left == 0 || step_events_completed >= current_block->step_event_count) {
+    unsigned char end_of_block = current_segment->end_of_block;
+    segment_buffer_tail = (segment_buffer_tail + 1) & (SEGMENT_BUFFER_SIZE - 1);
+    current_segment = NULL;
+    publish_position();
+
     // If current block is finished, reset pointer
     if (step_events_completed >= current_block->step_event_count) {
+      if (segment_steps_left || !end_of_block) {
+        // The rest of the block is still in the buffer, drop everything and let st_prep_buffer() start
+        // over at the next block
+        segment_buffer_tail = segment_buffer_head;
+        segment_buffer_flushes++;
+      }
       current_block = NULL;
       plan_discard_current_block();
     }
   }
 }
+
+ISR(TIMER1_COMPA_vect)
+{
+  #ifdef ISR_PROFILING
+    unsigned short entry = ISR_PROFILE_CLOCK;
+  #endif
+  stepper_isr();
+  #ifdef ISR_PROFILING
+    // Late if the next compare match already happened, or OCR1A was set behind the counter, which then
+    // runs through 0xFFFF first
+    isr_profile_record(stepper_isr_profile, entry, (TIFR1 & (1<<OCF1A)) || TCNT1 > OCR1A);
+  #endif
+}
+
+#ifdef ISR_PROFILING
+isr_profile_t stepper_isr_profile;
+isr_profile_t temp_isr_profile;
+
+static void reset_isr_profile(isr_profile_t &profile)
+{
+  profile.min_cycles = 0xFFFF;
+  profile.max_cycles = 0;
+  profile.total_cycles = 0;
+  profile.total_count = 0;
+  profile.total_events = 0;
+  profile.count = 0;
+  profile.late = 0;
+}
+
+static void print_isr_profile(const char *name, isr_profile_t &profile)
+{
+  isr_profile_t copy;
+  CRITICAL_SECTION_START;
+  copy = profile;
+  CRITICAL_SECTION_END;
+  serialprintPGM(name);
+  SERIAL_PROTOCOLPGM(" min:");
+  SERIAL_PROTOCOL(copy.count ? copy.min_cycles : 0);
+  SERIAL_PROTOCOLPGM(" max:");
+  SERIAL_PROTOCOL(copy.max_cycles);
+  SERIAL_PROTOCOLPGM(" mean:");
+  SERIAL_PROTOCOL(copy.total_count ? copy.total_cycles / copy.total_count : 0);
+  if(copy.total_events) {
+    SERIAL_PROTOCOLPGM(" per step event:");
+    SERIAL_PROTOCOL(copy.total_cycles / copy.total_events);
+  }
+  SERIAL_PROTOCOLPGM(" count:");
+  SERIAL_PROTOCOL(copy.count);
+  SERIAL_PROTOCOLPGM(" late:");
+  SERIAL_PROTOCOL(copy.late);
+  SERIAL_PROTOCOLLNPGM(" cycles");
+}
+
+void st_report_isr_profile(bool reset)
+{
+  print_isr_profile(PSTR("Stepper ISR"), stepper_isr_profile);
+  print_isr_profile(PSTR("Temp ISR"), temp_isr_profile);
+  if(reset) {
+    CRITICAL_SECTION_START;
+    reset_isr_profile(stepper_isr_profile);
+    reset_isr_profile(temp_isr_profile);
+    CRITICAL_SECTION_END;
+  }
+}
+#endif
+
 void st_init()
 {
   digipot_init(); //Initialize Digipot Motor Current
@@ -683,6 +1398,10 @@ void st_init()
     #endif
   #endif
 
+  #ifdef ENDSTOP_INTERRUPTS
+    setup_endstop_interrupts();
+  #endif
+
 
   //Initialize Step Pins
   #if defined(X_STEP_PIN) && (X_STEP_PIN > -1)
@@ -741,13 +1460,21 @@ void st_init()
 
   // Set the timer pre-scaler
   // Generally we use a divider of 8, resulting in a 2MHz timer
-  // frequency on a 16MHz MCU. If you are going to change this, be
-  // sure to regenerate speed_lookuptable.h with
-  // create_speed_lookuptable.py
-  TCCR1B = (TCCR1B & ~(0x07<<CS10)) | (2<<CS10);
+  // frequency on a 16MHz MCU. See STEPPER_TIMER_PRESCALER, the
+  // speed lookup tables follow it.
+  TCCR1B = (TCCR1B & ~(0x07<<CS10)) | (STEPPER_TIMER_CLOCK_SELECT<<CS10);
 
   OCR1A = 0x4000;
   TCNT1 = 0;
+
+  #ifdef ISR_PROFILING
+    // Timer 5 counts CPU cycles for the interrupt profile: normal mode, no prescaler
+    TCCR5A = 0;
+    TCCR5B = (1<<CS50);
+    reset_isr_profile(stepper_isr_profile);
+    reset_isr_profile(temp_isr_profile);
+  #endif
+
   ENABLE_STEPPER_DRIVER_INTERRUPT();
 
   enable_endstops(true); // Start with endstops active. After homing they can be disabled
@@ -772,6 +1499,7 @@ void st_set_position(const long &x, const long &y, const long &z, const long &e)
   count_position[Y_AXIS] = y;
   count_position[Z_AXIS] = z;
   count_position[E_AXIS] = e;
+  publish_position();
   CRITICAL_SECTION_END;
 }
 
@@ -779,18 +1507,33 @@ void st_set_e_position(const long &e)
 {
   CRITICAL_SECTION_START;
   count_position[E_AXIS] = e;
+  publish_position();
   CRITICAL_SECTION_END;
 }
 
 long st_get_position(uint8_t axis)
 {
   long count_pos;
-  CRITICAL_SECTION_START;
-  count_pos = count_position[axis];
-  CRITICAL_SECTION_END;
+  unsigned char sequence;
+  do {
+    sequence = position_sequence;
+    count_pos = position_snapshot[axis];
+  } while((sequence & 1) || sequence != position_sequence);
   return count_pos;
 }
 
+void st_get_positions(long position[NUM_AXIS])
+{
+  unsigned char sequence;
+  do {
+    sequence = position_sequence;
+    position[X_AXIS] = position_snapshot[X_AXIS];
+    position[Y_AXIS] = position_snapshot[Y_AXIS];
+    position[Z_AXIS] = position_snapshot[Z_AXIS];
+    position[E_AXIS] = position_snapshot[E_AXIS];
+  } while((sequence & 1) || sequence != position_sequence);
+}
+
 void finishAndDisableSteppers()
 {
   st_synchronize();
@@ -802,13 +1545,42 @@ void finishAndDisableSteppers()
   disable_e2();
 }
 
+void st_feed_hold()
+{
+  hold_request = FEED_HOLD_REQUEST;
+}
+
+void st_cycle_start()
+{
+  hold_request = CYCLE_START_REQUEST;
+}
+
 void quickStop()
 {
+  // Decelerate like a feed hold and wait for the axes to stand still
+  hold_request = FEED_HOLD_REQUEST;
+  do {
+    manage_heater();
+    manage_inactivity();
+    lcd_update();
+  } while(hold_state != FEED_HOLD_STOPPED || segment_buffer_head != segment_buffer_tail);
+
   DISABLE_STEPPER_DRIVER_INTERRUPT();
   while(blocks_queued())
     plan_discard_current_block();
+  block_buffer_planned = block_buffer_tail;
   current_block = NULL;
+  current_segment = NULL;
+  segment_buffer_tail = segment_buffer_head;
+  segment_buffer_flushes++;
+  hold_state = FEED_HOLD_OFF;
   ENABLE_STEPPER_DRIVER_INTERRUPT();
+
+  // The planner continues from where the steppers stopped
+  plan_set_position(st_get_position(X_AXIS) / axis_steps_per_unit[X_AXIS],
+                    st_get_position(Y_AXIS) / axis_steps_per_unit[Y_AXIS],
+                    st_get_position(Z_AXIS) / axis_steps_per_unit[Z_AXIS],
+                    st_get_position(E_AXIS) / axis_steps_per_unit[E_AXIS]);
 }
 
 void digitalPotWrite(int address, int value) // From Arduino DigitalPotControl example
@@ -23,6 +23,12 @@
 
 #include "planner.h"
 
+#define STEPPER_TIMER_RATE (F_CPU / STEPPER_TIMER_PRESCALER) // Stepper timer ticks per second
+
+// The ramps take acceleration_st * 2^24 / STEPPER_TIMER_RATE as a 24 bit operand of MultiU24X24toH16(),
+// which only fits for accelerations below STEPPER_TIMER_RATE steps/s^2. The planner limits the blocks.
+#define MAX_ACCELERATION_ST (STEPPER_TIMER_RATE - 1)
+
 #if EXTRUDERS > 2
   #define WRITE_E_STEP(v) { if(current_block->active_extruder == 2) { WRITE(E2_STEP_PIN, v); } else { if(current_block->active_extruder == 1) { WRITE(E1_STEP_PIN, v); } else { WRITE(E0_STEP_PIN, v); }}}
   #define NORM_E_DIR() { if(current_block->active_extruder == 2) { WRITE(E2_DIR_PIN, !INVERT_E2_DIR); } else { if(current_block->active_extruder == 1) { WRITE(E1_DIR_PIN, !INVERT_E1_DIR); } else { WRITE(E0_DIR_PIN, !INVERT_E0_DIR); }}}
@@ -47,27 +53,85 @@ void st_synchronize();
 void st_set_position(const long &x, const long &y, const long &z, const long &e);
 void st_set_e_position(const long &e);
 
-// Get current position in steps
+// Get current position in steps. The position is updated at the end of every segment, so while moving
+// it trails the steppers by up to SEGMENT_TIME. Reading it does not block the stepper interrupt.
 long st_get_position(uint8_t axis);
 
+// Same for all axes at once, the XYZE position of one point in time
+void st_get_positions(long position[NUM_AXIS]);
+
 // The stepper subsystem goes to sleep when it runs out of things to execute. Call this
 // to notify the subsystem that it is time to go to work.
 void st_wake_up();
 
+// Cuts the planned blocks into the segments the stepper interrupt executes. Has to be called
+// often enough to keep SEGMENT_BUFFER_SIZE segments ahead of the interrupt while moving.
+void st_prep_buffer();
+
   
 void checkHitEndstops(); //call from somewhere to create an serial error message with the locations the endstops where hit, in case they were triggered
 void endstops_hit_on_purpose(); //avoid creation of the message, i.e. after homing and before a routine call of checkHitEndstops();
 
 void enable_endstops(bool check); // Enable/disable endstop checking
 
+#ifdef ENDSTOP_INTERRUPTS
+void endstop_debounce(); // Re-arms endstops once released and polls the others, call at about 1kHz from an interrupt
+#endif
+
 void checkStepperErrors(); //Print errors detected by the stepper
 
 void finishAndDisableSteppers();
 
 extern block_t *current_block;  // A pointer to the block currently being traced
 
+// Ramps the axes down to a stop at the acceleration of the block being executed, then drops the rest
+// of the plan. The planner continues from the position the steppers stopped at, current_position
+// has to be taken from st_get_position() by the caller.
 void quickStop();
 
+// Feed hold: decelerate to a stop and keep the rest of the plan until st_cycle_start(). Both only
+// post a request for st_prep_buffer(), so they can be called from interrupts.
+void st_feed_hold();
+void st_cycle_start();
+
+#ifdef ISR_PROFILING
+// Cycle budget of an interrupt handler, see ISR_PROFILING
+typedef struct {
+  unsigned short min_cycles;
+  unsigned short max_cycles;
+  unsigned long total_cycles;   // Cycles of the last total_count interrupts, both are halved before they overflow
+  unsigned long total_count;
+  unsigned long total_events;   // Step events in those interrupts, stepper interrupt only
+  unsigned long count;          // Interrupts since the last reset
+  unsigned long late;           // Interrupts that ended after their next deadline
+} isr_profile_t;
+
+extern isr_profile_t stepper_isr_profile;
+extern isr_profile_t temp_isr_profile;
+
+#define ISR_PROFILE_CLOCK TCNT5 // Free running at F_CPU, set up by st_init()
+
+// Called at the end of an interrupt handler with the ISR_PROFILE_CLOCK it read on entry
+FORCE_INLINE void isr_profile_record(isr_profile_t &profile, unsigned short entry, bool late)
+{
+  unsigned short cycles = ISR_PROFILE_CLOCK - entry;
+  if(cycles < profile.min_cycles) profile.min_cycles = cycles;
+  if(cycles > profile.max_cycles) profile.max_cycles = cycles;
+  if(profile.total_cycles & 0x80000000) {
+    profile.total_cycles >>= 1;
+    profile.total_count >>= 1;
+    profile.total_events >>= 1;
+  }
+  profile.total_cycles += cycles;
+  profile.total_count++;
+  profile.count++;
+  if(late) profile.late++;
+}
+
+// M412: prints both profiles, then starts over if reset is set
+void st_report_isr_profile(bool reset);
+#endif
+
 void digitalPotWrite(int address, int value);
 void microstep_ms(uint8_t driver, int8_t ms1, int8_t ms2);
 void microstep_mode(uint8_t driver, uint8_t stepping);
@@ -33,6 +33,7 @@
 #include "ultralcd.h"
 #include "temperature.h"
 #include "watchdog.h"
+#include "stepper.h"
 
 //===========================================================================
 //=============================public variables============================
@@ -976,8 +977,8 @@ int read_max6675()
 #endif
 
 
-// Timer 0 is shared with millies
-ISR(TIMER0_COMPB_vect)
+// The temperature interrupt, called at 1kHz
+FORCE_INLINE void temp_isr()
 {
   //these variables are only accesible from the ISR, but static, so they don't lose their value
   static unsigned char temp_count = 0;
@@ -998,6 +999,10 @@ ISR(TIMER0_COMPB_vect)
   static unsigned char soft_pwm_b;
 #endif
 
+#ifdef ENDSTOP_INTERRUPTS
+  endstop_debounce();
+#endif
+
   if (pwm_count == 0) {
     soft_pwm_0 = soft_pwm[0];
     if (soft_pwm_0 > 0) {
@@ -1211,6 +1216,18 @@ ISR(TIMER0_COMPB_vect)
   }
 }
 
+// Timer 0 is shared with millies
+ISR(TIMER0_COMPB_vect)
+{
+  #ifdef ISR_PROFILING
+    unsigned short entry = ISR_PROFILE_CLOCK;
+  #endif
+  temp_isr();
+  #ifdef ISR_PROFILING
+    isr_profile_record(temp_isr_profile, entry, false);
+  #endif
+}
+
 #ifdef PIDTEMP
 // Apply the scale factors to the PID values
 
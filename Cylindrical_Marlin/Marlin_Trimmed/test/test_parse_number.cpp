@@ -0,0 +1,107 @@
+// Checks GCodeParser::parse_float() and parse_long() of gcode.cpp against strtod() and strtol(), and
+// times them on the host. Fails when a number parses more than one float ulp away from strtod(), or
+// when the documented gaps behave otherwise: no exponent ("1e5" is 1), and digits past the 9 or 10
+// that fit the 32 bit accumulator only shift the exponent. Host timings do not carry over to the AVR,
+// they only show the ratio.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// gcode.cpp only needs these from Marlin.h, which pulls in the AVR and Arduino headers
+#define MARLIN_H
+#define PROGMEM
+#define pgm_read_float_near(p) (*(p))
+
+#include "gcode.cpp"
+
+#define NUMBERS 1000000
+
+static uint32_t random_state = 2463534242UL;
+static uint32_t random_below(uint32_t limit)
+{
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state % limit;
+}
+
+// Distance of two floats in units of the last place
+static long ulps(float a, float b)
+{
+  int32_t ia, ib;
+  memcpy(&ia, &a, sizeof(ia));
+  memcpy(&ib, &b, sizeof(ib));
+  if (ia < 0) ia = INT32_MIN - ia;
+  if (ib < 0) ib = INT32_MIN - ib;
+  return labs((long)ia - ib);
+}
+
+// A number like G-code writes it: a sign, up to 6 integer digits, a point and up to 6 fraction digits
+static void random_number(char *s)
+{
+  if (random_below(3) == 0) *s++ = '-';
+  for (uint32_t n = random_below(7); n > 0; n--) *s++ = '0' + random_below(10);
+  if (random_below(4)) {
+    *s++ = '.';
+    for (uint32_t n = random_below(7); n > 0; n--) *s++ = '0' + random_below(10);
+  }
+  *s = 0;
+}
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  if (!ok) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+int main()
+{
+  static char numbers[NUMBERS][16];
+  for (long i = 0; i < NUMBERS; i++) random_number(numbers[i]);
+
+  long worst = 0, over = 0;
+  for (long i = 0; i < NUMBERS; i++) {
+    long d = ulps(GCodeParser::parse_float(numbers[i]), strtod(numbers[i], NULL));
+    if (d > worst) worst = d;
+    if (d > 1 && over++ < 10) printf("%s: %ld ulps from strtod()\n", numbers[i], d);
+  }
+  check(over == 0, "parse_float() within one ulp of strtod()");
+
+  long long_mismatches = 0;
+  for (long i = 0; i < NUMBERS; i++) {
+    if (GCodeParser::parse_long(numbers[i]) != strtol(numbers[i], NULL, 10) && long_mismatches++ < 10)
+      printf("%s: parse_long() %ld, strtol() %ld\n", numbers[i], GCodeParser::parse_long(numbers[i]), strtol(numbers[i], NULL, 10));
+  }
+  check(long_mismatches == 0, "parse_long() equals strtol()");
+
+  // Where parsing stops and the documented gaps
+  check(GCodeParser::parse_float("  +12.5X3") == 12.5f, "leading spaces and sign, stops at the next letter");
+  check(GCodeParser::parse_float(".25") == 0.25f, "fraction without integer digits");
+  check(GCodeParser::parse_float("X") == 0.0f, "no number is 0");
+  check(GCodeParser::parse_float("1e5") == 1.0f, "no exponent, \"1e5\" is 1");
+  check(GCodeParser::parse_float("9999999999") == GCodeParser::parse_float("9999999990"), "the 10th digit of 9999999999 only shifts the exponent");
+  check(ulps(GCodeParser::parse_float("9999999999"), 9999999999.0) <= 1, "9999999999 still within one ulp");
+  check(GCodeParser::parse_float("0.12345678901234") == GCodeParser::parse_float("0.1234567890"), "fraction digits past the accumulator are dropped");
+  check(GCodeParser::parse_long("-12.7") == -12, "parse_long() stops at the point");
+
+  // Host timing of the same numbers
+  volatile float sink = 0;
+  clock_t start = clock();
+  for (long i = 0; i < NUMBERS; i++) sink += GCodeParser::parse_float(numbers[i]);
+  double parse_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+  start = clock();
+  for (long i = 0; i < NUMBERS; i++) sink += strtod(numbers[i], NULL);
+  double strtod_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  printf("test_parse_number: %d numbers, parse_float() within %ld ulp of strtod(), %.1f ns against %.1f ns per number on this host: %s\n",
+    NUMBERS, worst, parse_time * 1e9 / NUMBERS, strtod_time * 1e9 / NUMBERS, failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,58 @@
+// Runs the float and the fixed point trapezoid generator of trapezoid.h side by side over randomized
+// blocks, the way calculate_trapezoid_for_block() calls them. Fails when accelerate_until or
+// decelerate_after of the two differ by more than one step.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// What Marlin.h and Arduino.h give the firmware, after the system headers like there
+#define FORCE_INLINE inline
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+
+#include "trapezoid.h"
+
+#define BLOCKS 2000000
+
+// Fixed seed, every run checks the same blocks
+static uint32_t random_state = 2463534242UL;
+static uint32_t random_below(uint32_t limit)
+{
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state % limit;
+}
+
+int main()
+{
+  long worst_until = 0, worst_after = 0, failures = 0;
+  for (long i = 0; i < BLOCKS; i++) {
+    unsigned short nominal_rate = 120 + random_below(60000);
+    unsigned long acceleration_st = 100 + random_below(400000);
+    unsigned long step_event_count = 1 + random_below(random_below(2) ? 200 : 200000);
+    // Entry and exit factors like the planner passes, the rates are clamped to 120 like there
+    unsigned long initial_rate = max(120UL, (unsigned long)ceil(nominal_rate * (random_below(10001) / 10000.0f)));
+    unsigned long final_rate = max(120UL, (unsigned long)ceil(nominal_rate * (random_below(10001) / 10000.0f)));
+
+    int32_t float_accelerate, float_plateau, fixed_accelerate, fixed_plateau;
+    trapezoid_steps_float(initial_rate, final_rate, nominal_rate, acceleration_st, step_event_count, float_accelerate, float_plateau);
+    trapezoid_steps_fixed(initial_rate, final_rate, nominal_rate, acceleration_st, step_event_count, fixed_accelerate, fixed_plateau);
+
+    long until = labs((long)fixed_accelerate - float_accelerate);
+    long after = labs((long)(fixed_accelerate + fixed_plateau) - (float_accelerate + float_plateau));
+    worst_until = max(worst_until, until);
+    worst_after = max(worst_after, after);
+    if (until > 1 || after > 1) {
+      if (failures++ < 10)
+        printf("rates %lu/%u/%lu accel %lu steps %lu: float %ld/%ld, fixed %ld/%ld\n", initial_rate, nominal_rate,
+          final_rate, acceleration_st, step_event_count, (long)float_accelerate, (long)(float_accelerate + float_plateau),
+          (long)fixed_accelerate, (long)(fixed_accelerate + fixed_plateau));
+    }
+  }
+  printf("test_trapezoid: %d blocks, accelerate_until within %ld, decelerate_after within %ld step(s): %s\n",
+    BLOCKS, worst_until, worst_after, failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,128 @@
+/*
+  trapezoid.h - step counts of the acceleration, cruise and deceleration of a block
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Used by calculate_trapezoid_for_block() in planner.cpp. Both generators are here, so test/ can build
+// them side by side on the host. Needs FORCE_INLINE, min() and max() from Marlin.h.
+
+#ifndef TRAPEZOID_H
+#define TRAPEZOID_H
+
+#include <math.h>
+#include <stdint.h>
+
+// Calculates the distance (not time) it takes to accelerate from initial_rate to target_rate using the
+// given acceleration:
+FORCE_INLINE float estimate_acceleration_distance(float initial_rate, float target_rate, float acceleration)
+{
+  if (acceleration!=0) {
+    return((target_rate*target_rate-initial_rate*initial_rate)/
+      (2.0*acceleration));
+  }
+  else {
+    return 0.0;  // acceleration was 0, set acceleration distance to 0
+  }
+}
+
+// This function gives you the point at which you must start braking (at the rate of -acceleration) if
+// you started at speed initial_rate and accelerated until this point and want to end at the final_rate after
+// a total travel of distance. This can be used to compute the intersection point between acceleration and
+// deceleration in the cases where the trapezoid has no plateau (i.e. never reaches maximum speed)
+
+FORCE_INLINE float intersection_distance(float initial_rate, float final_rate, float acceleration, float distance)
+{
+  if (acceleration!=0) {
+    return((2.0*acceleration*distance-initial_rate*initial_rate+final_rate*final_rate)/
+      (4.0*acceleration) );
+  }
+  else {
+    return 0.0;  // acceleration was 0, set intersection distance to 0
+  }
+}
+
+// Integer division rounding towards plus infinity
+FORCE_INLINE uint32_t ceil_div(uint32_t numerator, uint32_t divisor)
+{
+  return (numerator + divisor - 1) / divisor;
+}
+
+// Square of a 16 bit step rate, always fits in 32 bits.
+FORCE_INLINE uint32_t rate_squared(uint32_t rate)
+{
+  return (uint32_t)(uint16_t)rate * (uint16_t)rate;
+}
+
+// The rates are in steps/s and at least 120, acceleration_st in steps/s^2. Both generators return the
+// steps to accelerate and to cruise at nominal_rate, the rest of step_event_count decelerates.
+FORCE_INLINE void trapezoid_steps_float(unsigned long initial_rate, unsigned long final_rate, unsigned short nominal_rate,
+  unsigned long acceleration_st, unsigned long step_event_count, int32_t &accelerate_steps, int32_t &plateau_steps)
+{
+  long acceleration = acceleration_st;
+  accelerate_steps =
+    ceil(estimate_acceleration_distance(initial_rate, nominal_rate, acceleration));
+  int32_t decelerate_steps =
+    floor(estimate_acceleration_distance(nominal_rate, final_rate, -acceleration));
+
+  // Calculate the size of Plateau of Nominal Rate.
+  plateau_steps = step_event_count-accelerate_steps-decelerate_steps;
+
+  // Is the Plateau of Nominal Rate smaller than nothing? That means no cruising, and we will
+  // have to use intersection_distance() to calculate when to abort acceleration and start braking
+  // in order to reach the final_rate exactly at the end of this block.
+  if (plateau_steps < 0) {
+    accelerate_steps = ceil(intersection_distance(initial_rate, final_rate, acceleration, step_event_count));
+    accelerate_steps = max(accelerate_steps,0); // Check limits due to numerical round-off
+    accelerate_steps = min((uint32_t)accelerate_steps,step_event_count);//(We can cast here to unsigned, because the above line ensures that we are above zero)
+    plateau_steps = 0;
+  }
+}
+
+// Same equations as estimate_acceleration_distance() and intersection_distance(), evaluated with
+// 32 bit integers. The block rates are 16 bit, so their squares can not overflow. The results are
+// within one step of trapezoid_steps_float(), test/test_trapezoid.cpp checks that.
+FORCE_INLINE void trapezoid_steps_fixed(unsigned long initial_rate, unsigned long final_rate, unsigned short nominal_rate,
+  unsigned long acceleration_st, unsigned long step_event_count, int32_t &accelerate_steps, int32_t &plateau_steps)
+{
+  uint32_t nominal_sq = rate_squared(nominal_rate);
+  uint32_t initial_sq = rate_squared(min(initial_rate, (unsigned long)nominal_rate));
+  uint32_t final_sq = rate_squared(min(final_rate, (unsigned long)nominal_rate));
+  uint32_t twice_acceleration = max(acceleration_st, 1UL) << 1;
+
+  accelerate_steps = ceil_div(nominal_sq - initial_sq, twice_acceleration);
+  int32_t decelerate_steps = (nominal_sq - final_sq) / twice_acceleration;
+
+  // Calculate the size of Plateau of Nominal Rate.
+  plateau_steps = step_event_count-accelerate_steps-decelerate_steps;
+
+  // Is the Plateau of Nominal Rate smaller than nothing? That means no cruising, and we will
+  // have to calculate when to abort acceleration and start braking in order to reach the final_rate
+  // exactly at the end of this block: (d + (final^2 - initial^2)/(2 a)) / 2, rounded up.
+  if (plateau_steps < 0) {
+    int32_t rate_steps;
+    if (final_sq >= initial_sq) {
+      rate_steps = ceil_div(final_sq - initial_sq, twice_acceleration);
+    }
+    else {
+      rate_steps = -(int32_t)((initial_sq - final_sq) / twice_acceleration);
+    }
+    accelerate_steps = ((int32_t)step_event_count + rate_steps + 1) >> 1;
+    accelerate_steps = max(accelerate_steps,0); // Check limits due to numerical round-off
+    accelerate_steps = min((uint32_t)accelerate_steps,step_event_count);//(We can cast here to unsigned, because the above line ensures that we are above zero)
+    plateau_steps = 0;
+  }
+}
+
+#endif // TRAPEZOID_H